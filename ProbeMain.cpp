@@ -9,10 +9,11 @@
 * The SQL statements for the required 
 * schema are provided in this DBAccess class definition.
 *
-* To compile, type: "g++ -std=c++11 -o dnsprobe ProbeMain.cpp  -I /usr/include/mysql++ -I /usr/include/mysql -L/usr/lib -L/usr/local/lib -lmysqlpp -lldns"
+* To compile, type: "g++ -std=c++11 -o dnsprobe ProbeMain.cpp  -I /usr/include/mysql++ -I /usr/include/mysql -L/usr/lib -L/usr/local/lib -lmysqlpp -lldns -lsqlite3 -pthread"
 */
 
 #include <iostream>
+#include <fstream>
 #include <memory>
 #include <cstdlib>
 #include <cstring>
@@ -26,15 +27,24 @@ int main(int argc, char* argv[]) {
   //Parse command-line parameters
   bool b_add_domains = false;
   bool b_delete_domains = false;
+  bool b_bulk_load = false;
   dnsprobe::Time probe_interval = dnsprobe::DEFAULT_PROBE_INTERVAL;
+  dnsprobe::Time domain_interval = 0;
+  size_t retention = 0;
+  dnsprobe::EngineConfig engine;
+  size_t workers = 0;
   const char *dbname = dnsprobe::DEFAULT_DB_NAME;
   const char *username = dnsprobe::DEFAULT_USER_NAME;
   const char *password = dnsprobe::DEFAULT_PASSWORD;
+  const char *sqlite_file = 0;
+  const char *store_directory = 0;
+  const char *backend = 0;
+  const char *import_file = 0;
   int ret = 0;
   opterr = 0;
 
   int c;
-  while ((c = getopt (argc, argv, "adhb:p:u:t:v:")) != -1)
+  while ((c = getopt (argc, argv, "adhlb:e:f:i:k:m:n:p:r:s:u:t:v:w:")) != -1)
     switch (c) {
       case 'a':
         b_add_domains = true;
@@ -42,9 +52,52 @@ int main(int argc, char* argv[]) {
       case 'd':
         b_delete_domains = true;
         break;
+      case 'l':
+        b_bulk_load = true;
+        break;
       case 'b':
         dbname = optarg;
         break;
+      case 'e':
+        if (!strcmp(optarg, "ldns")) 
+          engine.type = dnsprobe::ENGINE_LDNS;
+        else if (!strcmp(optarg, "mmsg")) 
+          engine.type = dnsprobe::ENGINE_MMSG;
+        else if (!strcmp(optarg, "uring")) 
+          engine.type = dnsprobe::ENGINE_URING;
+        else if (strcmp(optarg, "epoll")) {
+          std::cerr << "Unknown engine `" << optarg << "'" << std::endl;
+          return 1;
+        }
+        break;
+      case 'f':
+        import_file = optarg;
+        break;
+      case 'i':
+        domain_interval = atoi(optarg);
+        break;
+      case 'r':
+        if (!engine.setResolver(optarg)) {
+          std::cerr << "Invalid resolver address `" << optarg << "'" << std::endl;
+          return 1;
+        }
+        break;
+      case 's':
+        sqlite_file = optarg;
+        break;
+      case 'k':
+        retention = atoi(optarg);
+        break;
+      case 'm':
+        store_directory = optarg;
+        break;
+      case 'n':
+        if (strcmp(optarg, "null") && strcmp(optarg, "memory")) {
+          std::cerr << "Unknown backend `" << optarg << "'" << std::endl;
+          return 1;
+        }
+        backend = optarg;
+        break;
       case 'u':
         username = optarg;
         break;
@@ -57,61 +110,109 @@ int main(int argc, char* argv[]) {
       case 'v':
         Log::LOG_LEVEL = atoi(optarg);
         break;
+      case 'w':
+        workers = atoi(optarg);
+        break;
       case '?':
-        if (optopt == 'b' || optopt == 'u' || optopt =='p'|| optopt == 't')
+        if (optopt == 'b' || optopt == 'e' || optopt == 'f' || optopt == 'i' || optopt == 'k' || optopt == 'm' || optopt == 'n' || optopt == 'u' || optopt =='p'|| optopt == 'r' || optopt == 's' || optopt == 't' || optopt == 'w')
           std::cerr << "Option '-" << static_cast<char>(optopt) << "' requires an argument." << std::endl;
         else 
           std::cerr <<  "Unknown option `-" <<  static_cast<char>(optopt) << "'" << std::endl;
+        // fall through
       default:
         ret = 1;
+        // fall through
       case 'h':
         std::cerr << "\nFills a [dnsprobe] database with DNS probe statistics. Durations are in ms." << std::endl
                   << "+------------i----------------------------------------------------------------" << std::endl
-                  << "Usage:\t" << argv[0] << " [-ad] [-b database] [-u username] [-p password] [-t probe_interval] [-v verbosity_level] [domain_1 ... domain_N]" << std::endl
+                  << "Usage:\t" << argv[0] << " [-adl] [-b database] [-e engine] [-f domain_file] [-i domain_interval] [-k retention_days] [-m store_directory] [-n backend] [-r resolver] [-s sqlite_file] [-u username] [-p password] [-t probe_interval] [-v verbosity_level] [-w workers] [domain_1 ... domain_N]" << std::endl
                   << "\t-a: add all domains" << std::endl
                   << "\t-d: delete all domains" << std::endl
+                  << "\t-l: load measurements in bulk with LOAD DATA LOCAL INFILE, local_infile must be enabled on the server" << std::endl
+                  << "\t-e: probe engine, epoll (default, concurrent queries), mmsg (batched epoll), uring (io_uring) or ldns (serial queries)" << std::endl
+                  << "\t-f: add the domains of a file, one per line or as rank,name, - for the standard input" << std::endl
+                  << "\t-i: probe interval of the added domains, the probe_interval of the vantage by default" << std::endl
+                  << "\t-k: days of measurements kept in the partitions of the MySQL measurement table, all by default, MySQL only" << std::endl
+                  << "\t-r: resolver as address[:port] or [address]:port, the first name server of /etc/resolv.conf by default" << std::endl
+                  << "\t-m: append measurements to memory-mapped segment files in a directory, statistics stay in the database" << std::endl
+                  << "\t-n: in-process backend for benchmarks instead of a database, null (discards statistics and measurements) or memory (keeps them in RAM)" << std::endl
+                  << "\t-s: store in an SQLite database file, created if needed, instead of MySQL" << std::endl
                   << "\t 0 = highest verbosity level, 1 = Lower (no debug messages) etc." << std::endl
+                  << "\t-w: number of probe threads, one per core by default" << std::endl
                   << "+-----------------------------------------------------------------------------" << std::endl
                   << "Author: Leonce Mekinda <sites.google.com/site/leoncemekinda>\n" << std::endl;
         return ret;
     }
 
+  // One backend at most, the series store goes with a database
+  if (backend && (sqlite_file || store_directory)) {
+    std::cerr << "Option '-n' cannot be combined with '-s' or '-m'" << std::endl;
+    return 1;
+  }
+
+  // Retention is kept by the partitions of MySQL only
+  if (retention && (backend || sqlite_file)) {
+    std::cerr << "Option '-k' requires the MySQL backend" << std::endl;
+    return 1;
+  }
+
   // Manage domains (insertion / deletion)
-  std::shared_ptr<dnsprobe::DBAccess> dbaccess(new dnsprobe::MySQLAccess);
-  dbaccess->connect(dbname, username, password);
+  std::shared_ptr<dnsprobe::DBAccess> dbaccess;
+  if (backend) 
+    dbaccess.reset(strcmp(backend, "null") ? new dnsprobe::InMemoryAccess : new dnsprobe::NullAccess);
+  else if (sqlite_file) 
+    dbaccess.reset(new dnsprobe::SQLiteAccess);
+  else
+    dbaccess.reset(new dnsprobe::MySQLAccess(b_bulk_load, retention));
+
+  // Measurements may go to a series store while statistics stay in the database
+  if (store_directory) 
+    dbaccess.reset(new dnsprobe::SeriesAccess(dbaccess, store_directory));
+
+  dbaccess->connect(sqlite_file ? sqlite_file : dbname, username, password);
 
   dnsprobe::Domains domains;
 
   if (b_delete_domains) {
-    // Delete every domain listed onthe comand line
-    for (int index = optind; index < argc; index++)
-      domains.push_back(dnsprobe::Domain(argv[index])); 
+    // Delete every domain listed onthe comand line, normalized as they were added
+    for (int index = optind; index < argc; index++) {
+      std::string name = argv[index];
+      if (dnsprobe::DomainImporter::normalize(name))
+        domains.push_back(dnsprobe::Domain(name)); 
+      else
+        Log::write(std::string("Invalid domain name ") + argv[index], Log::LOG_WARN, __FUNCTION__, __LINE__); 
+    }
     
-    dbaccess->deleteDomains(domains);
+    if (domains.size()) dbaccess->deleteDomains(domains);
 
-  } else if (b_add_domains) {
+  } else if (b_add_domains || import_file) {
 
-  dnsprobe::Domains old_domains;
-  dbaccess->loadDomains(old_domains);
+    dnsprobe::DomainImporter importer(*dbaccess, domain_interval);
+    importer.load();
 
-    // Insert new domains only
-    for (int index = optind; index < argc; index++) {
-      bool b_exists = false;
-      for (const auto& domain : old_domains) {
-        if (!strncmp(domain.getName().c_str(), argv[index], domain.getName().length())) {
-          Log::write("Domain " + domain.getName() + " already in database.", Log::LOG_DEBUG, __FUNCTION__, __LINE__);
-          b_exists = true;
-          break;
-        }
+    // Insert new domains only, from the command line then from the file
+    for (int index = optind; index < argc; index++)
+      importer.add(argv[index]);
+    importer.flush();
+
+    if (import_file) {
+      std::ifstream file;
+      if (strcmp(import_file, "-")) file.open(import_file);
+      if (strcmp(import_file, "-") && !file) {
+        std::cerr << "Cannot open `" << import_file << "'" << std::endl;
+        return 1;
       }
-      if (!b_exists) domains.push_back(dnsprobe::Domain(argv[index])); 
+      importer.import(strcmp(import_file, "-") ? file : std::cin);
     }
-    dbaccess->addDomains(domains);
+
+    std::stringstream msg;
+    msg << "Added " << importer.getAdded() << " domains, " << importer.getDuplicates() << " already known, " << importer.getInvalid() << " invalid";
+    Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__);
   }
 
 
   // Launch Vantage point
-  dnsprobe::Vantage::getInstance().start(dbaccess, probe_interval);
+  dnsprobe::Vantage::getInstance().start(dbaccess, probe_interval, dnsprobe::DEFAULT_DB_UPDATE_FREQ, engine, workers);
 
   dbaccess->disconnect();
 
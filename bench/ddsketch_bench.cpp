@@ -0,0 +1,94 @@
+/**
+* @file ddsketch_bench.cpp
+* @brief Query time sketch benchmark: inserts, window merges, encoding and accuracy
+*
+* Log-normal query times with a tail of timeouts are added to a sketch, then
+* split into windows the way flushes persist them, encoded, decoded and merged
+* back as a read over a time range does. The quantiles of the merged sketch
+* are compared with the exact ones, they must come within the accuracy.
+* Counts beyond 32 bits must survive merges.
+*
+* To compile, type: "g++ -std=c++11 -O2 -o ddsketch_bench bench/ddsketch_bench.cpp -I. -I /usr/include/mysql++ -I /usr/include/mysql -L/usr/lib -L/usr/local/lib -lmysqlpp -lldns -lsqlite3 -pthread"
+* Usage: ddsketch_bench [-n values] [-w values_per_window]
+*/
+
+#include <iostream>
+#include <random>
+#include <cstdlib>
+#include <getopt.h>
+#include "dnsprobe.h"
+
+int Log::LOG_LEVEL = LOG_WARN;
+
+using namespace dnsprobe;
+
+int main(int argc, char* argv[]) {
+
+  size_t count = 10000000;
+  size_t window = 100;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:w:")) != -1)
+    switch (c) {
+      case 'n': count = atol(optarg); break;
+      case 'w': window = std::max(1L, atol(optarg)); break;
+      default:
+        std::cerr << "Usage: " << argv[0] << " [-n values] [-w values_per_window]" << std::endl;
+        return 1;
+    }
+
+  std::mt19937_64 random(22);
+  std::lognormal_distribution<double> query_time(3.0, 0.8);
+  std::vector<double> values(count);
+  for (auto& value : values) value = random() % 100 < 3 ? 1000 + random() % 4000 : query_time(random);
+
+  // Inserts into a single sketch
+  DDSketch sketch;
+  double start = monotonicTime();
+  for (double value : values) sketch.add(value);
+  double elapsed = monotonicTime() - start;
+  std::cout << "insert: " << count << " values in " << elapsed << " ms, " << count / elapsed / 1e+3 << " M values/s" << std::endl;
+
+  // Windows encoded as a flush writes them
+  std::vector<std::string> encoded;
+  size_t bytes = 0;
+  for (size_t first = 0; first < count; first += window) {
+    DDSketch part;
+    for (size_t i = first; i < std::min(count, first + window); i++) part.add(values[i]);
+    encoded.push_back(part.encode());
+    bytes += encoded.back().size();
+  }
+
+  // Decoded and merged as a read over the range does
+  DDSketch merged;
+  start = monotonicTime();
+  for (auto& data : encoded) {
+    DDSketch part;
+    if (part.decode(data.data(), data.size())) merged.merge(part);
+  }
+  elapsed = monotonicTime() - start;
+  std::cout << "merge: " << encoded.size() << " windows of " << window << " values, " << bytes / encoded.size() << " bytes avg, decoded and merged in "
+            << elapsed << " ms, " << encoded.size() / elapsed / 1e+3 << " M windows/s" << std::endl;
+
+  // Quantiles against the exact ones
+  std::sort(values.begin(), values.end());
+  int failures = 0;
+  for (double fraction : {0.5, 0.9, 0.99, 0.999}) {
+    double exact = values[size_t(fraction * (count - 1))];
+    double error = fabs(merged.getPercentile(fraction) - exact) / exact;
+    std::cout << "p" << fraction * 100 << ": exact " << exact << " ms, sketch " << sketch.getPercentile(fraction) << " ms, merged "
+              << merged.getPercentile(fraction) << " ms, error " << error * 100 << "%" << std::endl;
+    if (error > DEFAULT_SKETCH_ACCURACY + 1e-9 || sketch.getPercentile(fraction) != merged.getPercentile(fraction)) failures++;
+  }
+
+  // Merges beyond 32-bit counts, as many vantage points over a long range give
+  DDSketch large, part;
+  part.add(10, (uint64_t(1) << 32) - 1);
+  for (int i = 0; i < 4; i++) large.merge(part);
+  DDSketch decoded;
+  std::string data = large.encode();
+  if (!decoded.decode(data.data(), data.size()) || decoded.getTotal() != 4 * ((uint64_t(1) << 32) - 1) || decoded.getPercentile(1) < 9.8) failures++;
+
+  if (merged.getTotal() != count || failures) std::cerr << failures << " checks failed" << std::endl;
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+/**
+* @file mysql_load_bench.cpp
+* @brief Measurement ingest benchmark: LOAD DATA LOCAL INFILE against prepared multi-row inserts
+*
+* Flushes of synthetic measurements are saved through MySQLAccess with bulk
+* loads off then on, and the rows/s of every mode are reported. A flush also
+* updates the rollups, which costs both modes the same. The domains are added
+* under their own suffix and deleted with their measurements at the end,
+* still, point it to a scratch database. Bulk loads need local_infile=1 on the
+* server.
+*
+* To compile, type: "g++ -std=c++11 -O2 -o mysql_load_bench bench/mysql_load_bench.cpp -I. -I /usr/include/mysql++ -I /usr/include/mysql -L/usr/lib -L/usr/local/lib -lmysqlpp -lldns -lsqlite3 -pthread"
+* Usage: mysql_load_bench -D dbname -u user -p password [-n domains] [-e events_per_domain] [-r rounds]
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <getopt.h>
+#include "dnsprobe.h"
+
+int Log::LOG_LEVEL = LOG_WARN;
+
+using namespace dnsprobe;
+
+/// Suffix of the synthetic domains
+static const std::string SUFFIX = ".mysql-load-bench.invalid";
+
+/// Queue the events of one flush, every domain is probed at every tick
+static void fill(Domains& domains, size_t events, Time start) {
+  for (auto& domain : domains)
+    for (size_t index = 0; index < events; index++) {
+      Event event;
+      event.time     = start + index;
+      event.target   = "x" + std::to_string(index % 1000) + "." + domain.getName();
+      event.event    = index % 33 ? EV_RECV_DATA : EV_TIMEOUT;
+      event.duration = index % 33 ? 5 + index % 80 : 1000;
+      domain.getEvents().push(event);
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+  const char* dbname = 0;
+  const char* username = 0;
+  const char* password = 0;
+  size_t domain_count = 10000;
+  size_t events = 10;
+  int rounds = 5;
+
+  int c;
+  while ((c = getopt(argc, argv, "D:u:p:n:e:r:")) != -1)
+    switch (c) {
+      case 'D': dbname = optarg; break;
+      case 'u': username = optarg; break;
+      case 'p': password = optarg; break;
+      case 'n': domain_count = atoi(optarg); break;
+      case 'e': events = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      default:
+        std::cerr << "Usage: " << argv[0] << " -D dbname -u user -p password [-n domains] [-e events_per_domain] [-r rounds]" << std::endl;
+        return 1;
+    }
+
+  if (!dbname || !username || !password) {
+    std::cerr << "Database name, user and password are required" << std::endl;
+    return 1;
+  }
+
+  // Add the domains then load them back with their ranks
+  Domains domains, loaded;
+  {
+    MySQLAccess dbaccess;
+    dbaccess.connect(dbname, username, password);
+    for (size_t index = 0; index < domain_count; index++) loaded.push_back(Domain("d" + std::to_string(index) + SUFFIX));
+    if (!dbaccess.addDomains(loaded) || !dbaccess.loadDomains(domains)) return 1;
+    dbaccess.disconnect();
+  }
+  auto other = [](const Domain& domain) { 
+    const std::string& name = domain.getName();
+    return name.size() < SUFFIX.size() || name.compare(name.size() - SUFFIX.size(), SUFFIX.size(), SUFFIX); 
+  };
+  domains.erase(std::remove_if(domains.begin(), domains.end(), other), domains.end());
+
+  Time start = time(0);
+  for (int bulk = 0; bulk <= 1; bulk++) {
+    MySQLAccess dbaccess(bulk);
+    dbaccess.connect(dbname, username, password);
+
+    double elapsed = 0;
+    size_t rows = 0;
+    for (int round = 0; round < rounds; round++) {
+      fill(domains, events, start + round * events);
+      double begin = monotonicTime();
+      bool saved = dbaccess.saveDomains(domains);
+      elapsed += monotonicTime() - begin;
+
+      for (auto& domain : domains) {
+        rows += events - domain.getEvents().size();
+        Events().swap(domain.getEvents());
+      }
+      if (!saved) std::cerr << "Flush " << round << " failed" << std::endl;
+    }
+
+    std::cout << (bulk ? "LOAD DATA: " : "INSERT:    ") << rows << " rows in " << elapsed << " ms, " << rows * 1e+3 / elapsed << " rows/s" << std::endl;
+    dbaccess.disconnect();
+  }
+
+  // Purge the synthetic domains and their rows
+  MySQLAccess dbaccess;
+  dbaccess.connect(dbname, username, password);
+  dbaccess.deleteDomains(domains);
+  dbaccess.disconnect();
+  return 0;
+}
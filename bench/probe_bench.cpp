@@ -0,0 +1,215 @@
+/**
+* @file probe_bench.cpp
+* @brief Probe engine benchmark against a loopback responder
+*
+* A responder thread answers every query on 127.0.0.1 with NXDOMAIN, so that
+* the figures only depend on the engine and the scheduler:
+* - burst mode (-b) sends the queries of all the domains at once and waits
+*   for the replies, syscalls are amortized over bursts of that size;
+* - scheduled mode (default) runs probe workers on their timing wheel for a
+*   while, probes are spread over the interval so that a tick only carries
+*   about domains / interval probes. The scheduler lag percentiles come from
+*   the workers.
+* The ldns engine is left out, it queries the resolvers of /etc/resolv.conf.
+*
+* To compile, type: "g++ -std=c++11 -O2 -o probe_bench bench/probe_bench.cpp -I. -I /usr/include/mysql++ -I /usr/include/mysql -L/usr/lib -L/usr/local/lib -lmysqlpp -lldns -lsqlite3 -pthread"
+* Usage: probe_bench [-b] [-e epoll|mmsg|uring] [-n domains] [-t probe_interval] [-d duration_s] [-r rounds] [-w workers]
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include "dnsprobe.h"
+
+int Log::LOG_LEVEL = LOG_WARN;
+
+using namespace dnsprobe;
+
+/**
+* @brief Loopback DNS responder turning every query into an NXDOMAIN reply
+*/
+class Responder {
+
+  static const unsigned BATCH = 256;
+
+  int _fd;
+  std::atomic<bool> _flag_stop;
+  std::thread _thread;
+  size_t _replies;
+
+  void run() {
+    static char buffers[BATCH][512];
+    struct mmsghdr messages[BATCH];
+    struct iovec iovecs[BATCH];
+    struct sockaddr_storage peers[BATCH];
+
+    while (!_flag_stop) {
+      for (unsigned i = 0; i < BATCH; i++) {
+        iovecs[i].iov_base = buffers[i];
+        iovecs[i].iov_len  = sizeof(buffers[i]);
+        memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_iov     = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen  = 1;
+        messages[i].msg_hdr.msg_name    = &peers[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+      }
+
+      int count = recvmmsg(_fd, messages, BATCH, MSG_WAITFORONE, NULL);
+      if (count <= 0) continue;
+
+      for (int i = 0; i < count; i++) {
+        buffers[i][2] |= 0x80;                          // QR
+        buffers[i][3]  = (buffers[i][3] & 0xf0) | 3;    // NXDOMAIN
+        iovecs[i].iov_len = messages[i].msg_len;
+      }
+      sendmmsg(_fd, messages, count, 0);
+      _replies += count;
+    }
+  }
+
+public:
+
+  Responder(): _fd(-1), _flag_stop(false), _replies(0) {}
+
+/// Bind an ephemeral port of the loopback and answer from a thread, returns the port
+  int start() {
+    _fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int size = 1 << 24;
+    setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    // Wake up regularly to check the stop flag
+    struct timeval timeout = {0, 100000};
+    setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(_fd, (struct sockaddr*)&address, sizeof(address)) || getsockname(_fd, (struct sockaddr*)&address, &length))
+      throw std::runtime_error(std::string("Cannot bind the responder: ") + strerror(errno));
+
+    _thread = std::thread(&Responder::run, this);
+    return ntohs(address.sin_port);
+  }
+
+  size_t stop() {
+    _flag_stop = true;
+    if (_thread.joinable()) _thread.join();
+    if (_fd >= 0) close(_fd);
+    _fd = -1;
+    return _replies;
+  }
+
+  ~Responder() { stop(); }
+};
+
+/// Print the counters of a run
+static void print(const char* mode, const EngineStats& stats, double elapsed, size_t burst) {
+  std::cout << mode << ": " << stats.queries << " probes in " << elapsed << " ms, " << stats.queries * 1e+3 / elapsed << " probes/s, "
+            << double(stats.syscalls) / std::max(stats.queries, size_t(1)) << " syscalls/probe, burst " << burst << " probes, "
+            << stats.replies << " replies, " << stats.timeouts << " timeouts, " << stats.errors << " errors" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+
+  bool b_burst = false;
+  EngineConfig engine;
+  size_t domain_count = 10000;
+  Time probe_interval = DEFAULT_PROBE_INTERVAL;
+  double duration = 10;
+  int rounds = 10;
+  size_t workers = 1;
+
+  int c;
+  while ((c = getopt(argc, argv, "bd:e:n:r:t:w:")) != -1)
+    switch (c) {
+      case 'b': b_burst = true; break;
+      case 'd': duration = atof(optarg); break;
+      case 'n': domain_count = atoi(optarg); break;
+      case 'r': rounds = atoi(optarg); break;
+      case 't': probe_interval = atoi(optarg); break;
+      case 'w': workers = std::max(1, atoi(optarg)); break;
+      case 'e':
+        if (!strcmp(optarg, "mmsg")) engine.type = ENGINE_MMSG;
+        else if (!strcmp(optarg, "uring")) engine.type = ENGINE_URING;
+        else if (strcmp(optarg, "epoll")) {
+          std::cerr << "Unknown engine `" << optarg << "'" << std::endl;
+          return 1;
+        }
+        break;
+      default:
+        std::cerr << "Usage: " << argv[0] << " [-b] [-e epoll|mmsg|uring] [-n domains] [-t probe_interval] [-d duration_s] [-r rounds] [-w workers]" << std::endl;
+        return 1;
+    }
+
+  Responder responder;
+  engine.setResolver("127.0.0.1:" + std::to_string(responder.start()));
+
+  Domains domains;
+  domains.reserve(domain_count);
+  for (size_t index = 0; index < domain_count; index++)
+    domains.push_back(Domain("d" + std::to_string(index) + ".example.com", index + 1));
+
+  if (b_burst) {
+    // Every round sends the queries of all the domains back to back
+    std::unique_ptr<ProbeEngine> probe(createEngine(engine));
+    probe->open(domains);
+
+    double start = monotonicTime();
+    for (int round = 0; round < rounds; round++) {
+      probe->probe(domains);
+      for (auto& domain : domains) Events().swap(domain.getEvents());
+    }
+    print("burst", probe->getStats(), monotonicTime() - start, domain_count);
+
+  } else {
+    std::atomic<bool> flag_stop(false);
+    ProbeWorkers shards;
+    for (size_t index = 0; index < workers; index++)
+      shards.push_back(std::shared_ptr<ProbeWorker>(new ProbeWorker(index)));
+    for (size_t index = 0; index < domain_count; index++)
+      shards[index % workers]->getDomains().push_back(std::move(domains[index]));
+
+    // Measurements are dropped at every hand-over
+    auto discard = [](Domains& shard, DomainTable& table) {
+      table.visitChanges([&shard, &table](size_t id) {
+        Events().swap(shard[id].getEvents());
+        table.setClean(id);
+      });
+      return true;
+    };
+
+    engine.timeout = std::min(engine.timeout, probe_interval);
+    for (auto& worker : shards) worker->open(engine);
+
+    double start = monotonicTime();
+    for (auto& worker : shards) worker->start(probe_interval, DEFAULT_DB_UPDATE_FREQ, flag_stop, discard);
+    usleep(useconds_t(duration * 1e+6));
+    flag_stop = true;
+    for (auto& worker : shards) worker->wake();
+    for (auto& worker : shards) worker->join();
+    double elapsed = monotonicTime() - start;
+
+    EngineStats stats = EngineStats();
+    DDSketch lag;
+    for (auto& worker : shards) {
+      const EngineStats& shard = worker->getEngineStats();
+      stats.queries  += shard.queries;
+      stats.replies  += shard.replies;
+      stats.timeouts += shard.timeouts;
+      stats.errors   += shard.errors;
+      stats.syscalls += shard.syscalls;
+      lag.merge(worker->getLag());
+    }
+
+    print("scheduled", stats, elapsed, std::max(size_t(1), domain_count / workers / std::max(Time(1), probe_interval)));
+    std::cout << "scheduler lag: p50 " << lag.getPercentile(0.5) << " ms, p99 " << lag.getPercentile(0.99) << " ms, p99.9 "
+              << lag.getPercentile(0.999) << " ms over " << lag.getTotal() << " probes" << std::endl;
+  }
+
+  responder.stop();
+  return 0;
+}
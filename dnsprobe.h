@@ -5,7 +5,8 @@
 * @brief Header file for the DNS Probe
 *
 * The program requires a MySQL database 
-* to be created beforehand.
+* to be created beforehand, or an SQLite
+* database file that is created on first use.
 * The SQL statements for the required 
 * schema are provided in this DBAccess class.
 */
@@ -14,14 +15,40 @@
 #define DNSPROBE_H
 
 #include <queue>
+#include <map>
+#include <deque>
 #include <ctime>
 #include <sstream>
 #include <stdexcept>
 #include <memory>
-#include <random>
+#include <algorithm>
+#include <cmath>
 #include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <sqlite3.h>
 #include "mysql++.h"
 #include "logger.h"
 
@@ -34,6 +61,26 @@ namespace dnsprobe {
 /// The Time in ms
 typedef unsigned long Time;
 
+/**
+* @brief Monotonic clock in ms, used to measure query durations and deadlines
+*/
+inline double monotonicTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e+3 + ts.tv_nsec / 1e+6;
+}
+
+/**
+* @brief SplitMix64 finalizer: a bijective mix of the 64 bits of its input
+* Hashing a seed plus a counter times the golden gamma yields the SplitMix64 
+* sequence, so any draw is computed from its index without generator state.
+*/
+inline uint64_t splitmix64(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
 //================================= Constants =======================================//
 
 const Time   DEFAULT_PROBE_INTERVAL = 1000; //1s
@@ -43,6 +90,21 @@ const char*  DEFAULT_USER_NAME      = "root";
 const char*  DEFAULT_PASSWORD       = "";
 const double DEFAULT_DB_UPDATE_FREQ = 4.;
 const int    DEFAULT_DNS_RETRY      = 2;
+const Time   DEFAULT_DNS_TIMEOUT    = 1000; //1s
+const int    DEFAULT_SOCKET_BUFFER  = 1 << 20; //1MB
+const size_t DEFAULT_DB_QUEUE_SIZE  = 64; //snapshots
+const size_t DEFAULT_DB_CHUNK_SIZE  = 1 << 22; //4MB statements at most
+const Time   DEFAULT_DB_RETRY_DELAY = 1000; //ms before a failed snapshot is written again, doubled up to the max
+const Time   DEFAULT_DB_RETRY_DELAY_MAX = 60000; //ms
+const size_t DEFAULT_DB_RETRY_STOP  = 3; //attempts left to a failed snapshot once the writer stops
+const size_t DEFAULT_PENDING_EVENTS = 600; //events kept per domain while the writer turns snapshots down, the oldest are dropped beyond
+const size_t DEFAULT_SEGMENT_SIZE   = 1 << 20; //records, 40MB files
+const size_t DEFAULT_IMPORT_BATCH   = 10000; //domains
+const size_t DEFAULT_DELETE_BATCH   = 1000; //domains
+const size_t DEFAULT_PURGE_BATCH    = 10000; //measurements per delete statement
+const double DEFAULT_SKETCH_ACCURACY = 0.01; //relative error of query time quantiles
+const size_t DEFAULT_PARTITIONS_AHEAD      = 3; //days
+const time_t DEFAULT_MAINTENANCE_INTERVAL  = 3600; //s
 
 //============================== Business objects ==================================//
 /**
@@ -67,117 +129,737 @@ struct Event {
 
 typedef std::queue<Event> Events;
 
+/**
+* @brief Pre-encoded DNS query for the random targets of a domain
+* The wire buffer keeps room for the longest random label in front of the 
+* encoded domain name. A query is produced by patching the ID and the label
+* in place and the packet starts where the header fits the label length.
+*/
+class QueryTemplate {
+
+public:
+
+  static const size_t MAX_LABEL = 10;
+
+private:
+
+  /// Offset of the encoded domain name
+  static const size_t TAIL = LDNS_HEADER_SIZE + 1 + MAX_LABEL;
+
+  std::vector<uint8_t> _wire;
+
+public:
+
+/**
+* @brief Encode the question for <label>.name, class IN and type A
+*/
+  bool compile(const std::string& name) {
+
+    _wire.assign(TAIL, 0);
+
+    for (const char* p = name.c_str(); *p; ) {
+      size_t len = strcspn(p, ".");
+      if (!len || len > LDNS_MAX_LABELLEN) {
+        _wire.clear();
+        return false;
+      }
+      _wire.push_back(len);
+      _wire.insert(_wire.end(), p, p + len);
+      p += len;
+      if (*p) p++;
+    }
+    _wire.push_back(0);
+
+    // The random label must still fit in the name
+    if (_wire.size() - TAIL + 1 + MAX_LABEL > LDNS_MAX_DOMAINLEN) {
+      _wire.clear();
+      return false;
+    }
+
+    const uint8_t type_class[] = {0, LDNS_RR_TYPE_A, 0, LDNS_RR_CLASS_IN};
+    _wire.insert(_wire.end(), type_class, type_class + sizeof(type_class));
+    return true;
+  }
+
+  bool isValid() const { return !_wire.empty(); }
+
+/**
+* @brief Patch the ID and the random label, returns the packet and its size
+*/
+  const uint8_t* patch(uint16_t id, const char* label, size_t len, size_t& size) {
+
+    // Header with RD set and a single question
+    static const uint8_t header[LDNS_HEADER_SIZE] = {0, 0, 0x01, 0, 0, 1, 0, 0, 0, 0, 0, 0};
+
+    uint8_t* packet = _wire.data() + MAX_LABEL - len;
+    memcpy(packet, header, LDNS_HEADER_SIZE);
+    packet[0] = id >> 8;
+    packet[1] = id & 0xff;
+    packet[LDNS_HEADER_SIZE] = len;
+    memcpy(packet + LDNS_HEADER_SIZE + 1, label, len);
+
+    size = _wire.size() - (MAX_LABEL - len);
+    return packet;
+  }
+
+/**
+* @brief Check that a reply carries the question sent with the given label
+*/
+  bool matches(const uint8_t* reply, size_t size, const char* label, size_t len) const {
+
+    size_t tail = _wire.size() - TAIL;
+    if (size < LDNS_HEADER_SIZE + 1 + len + tail) return false;
+
+    const uint8_t* question = reply + LDNS_HEADER_SIZE;
+    return question[0] == len && !memcmp(question + 1, label, len) && !memcmp(question + 1 + len, _wire.data() + TAIL, tail);
+  }
+};
+
+/**
+* @brief Streaming mean and variance (Welford), mergeable (Chan et al.)
+* The sum of squared deviations M2 is updated in place, which keeps its precision
+* over any number of samples where sums of squares cancel out.
+*/
+class StreamingMoments {
+
+  uint64_t _count;
+  double _mean;
+  double _m2;
+
+public:
+
+/// Restore persisted statistics, the standard deviation being the biased one
+  StreamingMoments(uint64_t count = 0, double mean = 0, double stddev = 0): _count(count), _mean(mean), _m2(stddev * stddev * count) {}
+
+  void add(double value) {
+    _count++;
+    double delta = value - _mean;
+    _mean += delta / _count;
+    _m2   += delta * (value - _mean);
+  }
+
+/**
+* @brief Add a batch of values: its mean then the squared deviations from it are 
+* computed in two passes, which is more accurate than adding them one by one, 
+* then merged. Four accumulators shorten the chain of dependent additions, 
+* the loops are not vectorized unless the build allows reassociation.
+*/
+  void add(const double* values, size_t count) {
+    if (!count) return;
+
+    double sums[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) 
+      for (unsigned j = 0; j < 4; j++) sums[j] += values[i + j];
+    for (; i < count; i++) sums[0] += values[i];
+    double mean = (sums[0] + sums[1] + sums[2] + sums[3]) / count;
+
+    double squares[4] = {0, 0, 0, 0};
+    for (i = 0; i + 4 <= count; i += 4) 
+      for (unsigned j = 0; j < 4; j++) squares[j] += (values[i + j] - mean) * (values[i + j] - mean);
+    for (; i < count; i++) squares[0] += (values[i] - mean) * (values[i] - mean);
+
+    merge(count, mean, squares[0] + squares[1] + squares[2] + squares[3]);
+  }
+
+  void merge(const StreamingMoments& other) { merge(other._count, other._mean, other._m2); }
+
+/// Merge the moments of count values of the given mean and sum of squared deviations
+  void merge(uint64_t count, double mean, double m2) {
+    if (!count) return;
+    uint64_t total = _count + count;
+    double delta = mean - _mean;
+    _mean += delta * count / total;
+    _m2   += m2 + delta * delta * _count * count / total;
+    _count = total;
+  }
+
+  uint64_t getCount() const { return _count; }
+  double getMean() const    { return _mean; }
+
+/// Biased variance, multiply by n/(n-1) for the unbiased one
+  double getVariance() const { return _count ? _m2 / _count : 0; }
+  double getStdDev() const   { return sqrt(getVariance()); }
+};
+
+/**
+* @brief Exponentially weighted mean and variance, recent samples weigh more
+* A weight a gives samples a half-life of about 0.69/a samples. Library only,
+* the prober keeps cumulative moments.
+*/
+class EwmaMoments {
+
+  double _weight;
+  uint64_t _count;
+  double _mean;
+  double _variance;
+
+public:
+
+  EwmaMoments(double weight = 0.1): _weight(weight), _count(0), _mean(0), _variance(0) {}
+
+  void add(double value) {
+    if (!_count++) {
+      _mean = value;
+      return;
+    }
+    double delta = value - _mean;
+    _mean    += _weight * delta;
+    _variance = (1 - _weight) * (_variance + _weight * delta * delta);
+  }
+
+  uint64_t getCount() const  { return _count; }
+  double getMean() const     { return _mean; }
+  double getVariance() const { return _variance; }
+  double getStdDev() const   { return sqrt(_variance); }
+};
+
+/**
+* @brief Mean and variance of the last samples of a sliding window
+* Samples leaving the window are removed by the inverse Welford update,
+* the moments are recomputed from the window once per window of samples
+* so that rounding does not build up. Library only, the prober keeps 
+* cumulative moments.
+*/
+class WindowMoments {
+
+  std::vector<double> _values;
+  size_t _size;
+  size_t _next;
+  size_t _replaced;
+  StreamingMoments _moments;
+
+public:
+
+  WindowMoments(size_t size): _size(std::max(size, size_t(1))), _next(0), _replaced(0) { _values.reserve(_size); }
+
+  void add(double value) {
+    if (_values.size() < _size) {
+      _values.push_back(value);
+      _moments.add(value);
+      return;
+    }
+
+    double old = _values[_next];
+    _values[_next] = value;
+    _next = (_next + 1) % _values.size();
+
+    if (++_replaced == _values.size()) {
+      _replaced = 0;
+      _moments = StreamingMoments();
+      _moments.add(_values.data(), _values.size());
+      return;
+    }
+
+    // Take the oldest out as the inverse update, then the new one in
+    uint64_t count = _moments.getCount() - 1;
+    double delta = old - _moments.getMean();
+    double mean = _moments.getMean() - delta / count;
+    double m2 = _moments.getVariance() * _moments.getCount() - delta * (old - mean);
+    _moments = StreamingMoments();
+    _moments.merge(count, mean, std::max(m2, 0.));
+    _moments.add(value);
+  }
+
+  uint64_t getCount() const  { return _moments.getCount(); }
+  double getMean() const     { return _moments.getMean(); }
+  double getVariance() const { return _moments.getVariance(); }
+  double getStdDev() const   { return _moments.getStdDev(); }
+};
+
+/**
+* @brief Mergeable quantile sketch of query times with relative accuracy (DDSketch)
+* Bin i counts the values in (gamma^(i-1), gamma^i] with gamma = (1+a)/(1-a), so 
+* every quantile comes within the accuracy a of the true one. Bins are kept in a 
+* contiguous window of at most MAX_BINS, beyond it the lowest bins are collapsed,
+* which only affects the lowest quantiles. Sketches of the same accuracy merge by 
+* adding their bins, whatever windows, flushes or vantage points they come from,
+* counts are 64-bit so that merges do not wrap.
+*/
+class DDSketch {
+
+public:
+
+  static const int MAX_BINS = 2048;
+
+  /// Serialization format, the first byte of the encoding
+  static const uint8_t FORMAT = 2;
+
+private:
+
+  /// Query times at or below it (ms) share the zero bin
+  static constexpr double MIN_VALUE = 1e-3;
+
+  double _gamma;
+  double _multiplier;
+  int _offset;
+  std::vector<uint64_t> _bins;
+  uint64_t _zero;
+  uint64_t _total;
+
+  int getIndex(double value) const { return int(ceil(log(value) * _multiplier)); }
+
+/// Middle of a bin, within the accuracy of all its values
+  double getValue(int index) const { return 2 * pow(_gamma, index) / (_gamma + 1); }
+
+/// Widen the window of bins to [low, high], collapsing the lowest ones beyond MAX_BINS
+  void extend(int low, int high) {
+
+    if (_bins.empty()) {
+      _offset = std::max(low, high - MAX_BINS + 1);
+      _bins.assign(high - _offset + 1, 0);
+      return;
+    }
+
+    low  = std::min(low, _offset);
+    high = std::max(high, _offset + int(_bins.size()) - 1);
+    low  = std::max(low, high - MAX_BINS + 1);
+    if (low == _offset && high == _offset + int(_bins.size()) - 1) return;
+
+    std::vector<uint64_t> bins(high - low + 1, 0);
+    for (int i = 0; i < int(_bins.size()); i++) bins[std::max(_offset + i, low) - low] += _bins[i];
+    _bins.swap(bins);
+    _offset = low;
+  }
+
+  void addToBin(int index, uint64_t count) {
+    if (_bins.empty() || index < _offset || index >= _offset + int(_bins.size())) extend(index, index);
+    _bins[std::max(index, _offset) - _offset] += count;
+  }
+
+public:
+
+  DDSketch(double accuracy = DEFAULT_SKETCH_ACCURACY): 
+    _gamma((1 + accuracy) / (1 - accuracy)), _multiplier(1 / log(_gamma)), _offset(0), _zero(0), _total(0) {}
+
+/// Record a query time in ms
+  void add(double value, uint64_t count = 1) {
+    _total += count;
+    if (value <= MIN_VALUE) _zero += count;
+    else addToBin(getIndex(value), count);
+  }
+
+/// Add the counts of a sketch of the same accuracy, returns false otherwise
+  bool merge(const DDSketch& other) {
+    if (fabs(other._gamma - _gamma) > 1e-12) return false;
+    if (!other._bins.empty()) {
+      extend(other._offset, other._offset + other._bins.size() - 1);
+      for (int i = 0; i < int(other._bins.size()); i++) 
+        if (other._bins[i]) _bins[std::max(other._offset + i, _offset) - _offset] += other._bins[i];
+    }
+    _zero  += other._zero;
+    _total += other._total;
+    return true;
+  }
+
+  uint64_t getTotal() const { return _total; }
+  double getAccuracy() const { return (_gamma - 1) / (_gamma + 1); }
+
+/// Query time in ms under which a fraction of the queries fall, 0 without records
+  double getPercentile(double fraction) const {
+    if (!_total) return 0;
+
+    uint64_t rank = uint64_t(std::min(std::max(fraction, 0.), 1.) * (_total - 1));
+    uint64_t seen = _zero;
+    if (seen > rank) return 0;
+    for (int i = 0; i < int(_bins.size()); i++) 
+      if ((seen += _bins[i]) > rank) return getValue(_offset + i);
+    return getValue(_offset + _bins.size() - 1);
+  }
+
+/**
+* @brief Compact encoding: the format, the accuracy, then varints of the zero count, 
+* the first bin and of the gap to the next used bin and its count
+*/
+  std::string encode() const {
+    std::string data(1, char(FORMAT));
+    double accuracy = getAccuracy();
+    data.append((const char*)&accuracy, sizeof(accuracy));
+
+    auto varint = [&data](uint64_t value) {
+      for (; value >= 0x80; value >>= 7) data.push_back(char(value | 0x80));
+      data.push_back(char(value));
+    };
+
+    varint(_zero);
+    varint((uint64_t(int64_t(_offset)) << 1) ^ uint64_t(int64_t(_offset) >> 63));
+    for (int i = 0, last = 0; i < int(_bins.size()); i++) {
+      if (!_bins[i]) continue;
+      varint(i - last);
+      varint(_bins[i]);
+      last = i;
+    }
+    return data;
+  }
+
+/// Restore an encoding, returns false and stays empty if it is not one
+  bool decode(const char* data, size_t size) {
+
+    _bins.clear();
+    _zero = _total = 0;
+
+    size_t position = 1;
+    auto varint = [&](uint64_t& value) {
+      value = 0;
+      for (unsigned shift = 0; position < size && shift < 64; shift += 7) {
+        uint8_t byte = data[position++];
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+      }
+      return false;
+    };
+
+    uint64_t zero, offset, gap, count;
+    double accuracy;
+
+    if (size < 1 + sizeof(accuracy) || uint8_t(data[0]) != FORMAT) return false;
+    memcpy(&accuracy, data + 1, sizeof(accuracy));
+    position += sizeof(accuracy);
+    if (!(accuracy > 0 && accuracy < 1) || !varint(zero) || !varint(offset)) return false;
+
+    DDSketch sketch(accuracy);
+    sketch._zero = sketch._total = zero;
+    int first = int64_t(offset >> 1) ^ -int64_t(offset & 1);
+    std::vector<std::pair<int, uint64_t> > bins;
+    for (int64_t index = first; position < size; index += gap) {
+      if (!varint(gap) || !varint(count) || index + int64_t(gap) - first >= MAX_BINS) return false;
+      bins.push_back(std::make_pair(index + gap, count));
+      sketch._total += count;
+    }
+
+    // One window for all the bins
+    if (bins.size()) sketch.extend(bins.front().first, bins.back().first);
+    for (auto& bin : bins) sketch._bins[bin.first - sketch._offset] += bin.second;
+
+    *this = sketch;
+    return true;
+  }
+};
+
+/**
+* @brief Hot statistics of a shard of domains as parallel arrays indexed by a dense id
+* Domains bound to the table update their row instead of their own members, so 
+* that scans for changes and aggregations stream through a few contiguous arrays 
+* rather than through whole domains with their names, queries and events.
+*/
+class DomainTable {
+
+  std::vector<uint64_t> _count;
+  std::vector<double> _mean;
+  std::vector<double> _m2;
+  std::vector<Time> _time_first;
+  std::vector<Time> _time_last;
+  std::vector<uint8_t> _changes;
+
+public:
+
+  /// Change flags of a row
+  enum { CHANGED_STATS = 1, CHANGED_EVENTS = 2 };
+
+  size_t size() const { return _count.size(); }
+
+  void reserve(size_t size) {
+    _count.reserve(size);
+    _mean.reserve(size);
+    _m2.reserve(size);
+    _time_first.reserve(size);
+    _time_last.reserve(size);
+    _changes.reserve(size);
+  }
+
+/// Append a row, returns its id
+  size_t add(const StreamingMoments& moments, Time time_first, Time time_last, uint8_t changes) {
+    _count.push_back(moments.getCount());
+    _mean.push_back(moments.getMean());
+    _m2.push_back(moments.getVariance() * moments.getCount());
+    _time_first.push_back(time_first);
+    _time_last.push_back(time_last);
+    _changes.push_back(changes);
+    return _count.size() - 1;
+  }
+
+/// Record an event of a row, statistics only change with replies
+  bool update(size_t id, const Event& event) {
+    _changes[id] |= CHANGED_EVENTS;
+    if (event.event != EV_RECV_DATA) return false;
+
+    _changes[id] |= CHANGED_STATS;
+    if (!_time_first[id]) _time_first[id] = event.time;
+    _time_last[id] = event.time;
+
+    double count = double(++_count[id]);
+    double delta = event.duration - _mean[id];
+    _mean[id] += delta / count;
+    _m2[id]   += delta * (event.duration - _mean[id]);
+    return true;
+  }
+
+  StreamingMoments getMoments(size_t id) const {
+    StreamingMoments moments;
+    moments.merge(_count[id], _mean[id], _m2[id]);
+    return moments;
+  }
+
+  Time getTimeFirst(size_t id) const  { return _time_first[id]; }
+  Time getTimeLast(size_t id) const   { return _time_last[id]; }
+  uint8_t getChanges(size_t id) const { return _changes[id]; }
+
+/// Mark a row as persisted
+  void setClean(size_t id) { _changes[id] = 0; }
+
+/// Number of rows with changes to persist
+  size_t countChanges() const {
+    size_t count = 0;
+    const uint8_t* changes = _changes.data();
+    for (size_t id = 0; id < _changes.size(); id++) count += changes[id] != 0;
+    return count;
+  }
+
+/// Call the visitor with the id of every row with changes, unchanged rows are skipped by words
+  template <typename Visitor> void visitChanges(Visitor visit) const {
+    size_t size = _changes.size(), id = 0;
+    for (; id + 8 <= size; id += 8) {
+      uint64_t word;
+      memcpy(&word, &_changes[id], sizeof(word));
+      if (!word) continue;
+      for (size_t i = id; i < id + 8; i++) 
+        if (_changes[i]) visit(i);
+    }
+    for (; id < size; id++) 
+      if (_changes[id]) visit(id);
+  }
+
+/**
+* @brief Query time moments of all the rows merged
+* The global mean comes first, then the squared deviations of the row means 
+* from it, in two passes over the arrays
+*/
+  StreamingMoments aggregate() const {
+    size_t size = _count.size();
+    StreamingMoments moments;
+
+    uint64_t total = 0;
+    double sum = 0;
+    for (size_t id = 0; id < size; id++) {
+      total += _count[id];
+      sum   += _count[id] * _mean[id];
+    }
+    if (!total) return moments;
+    double global = sum / total;
+
+    double squares = 0;
+    for (size_t id = 0; id < size; id++) {
+      double delta = _mean[id] - global;
+      squares += _m2[id] + _count[id] * delta * delta;
+    }
+
+    moments.merge(total, global, squares);
+    return moments;
+  }
+};
+
 /**
 * @brief The domain to be probed
+* Once bound to a DomainTable, the statistics live in its row and copies 
+* share that row until they are detached.
 */
 class Domain {
 
   size_t _rank;
   std::string _name;
-  double _query_time_avg;
-  double _query_time_stddev;
-  size_t _query_count;
+  StreamingMoments _query_time;
   Time _time_first;
   Time _time_last;
+  Time _probe_interval;
   Events _events;
+  QueryTemplate _query;
+
+  /// Query times since the last snapshot, persisted window by window
+  DDSketch _sketch;
+
+  /// Statistics changed since they were last persisted
+  bool _dirty;
+
+  /// Events dropped beyond DEFAULT_PENDING_EVENTS since the last snapshot
+  size_t _dropped;
+
+  /// Row holding the statistics when bound
+  DomainTable* _table;
+  size_t _id;
 
-  // Randomness
-  std::default_random_engine _PRNG;
-  std::uniform_int_distribution<int> _random_length = std::uniform_int_distribution<int>(4, 10);
-  std::uniform_int_distribution<int> _random_char = std::uniform_int_distribution<int>(0, 35);
+  // Random labels: the n-th one is drawn from the hash of the name and n
+  uint64_t _seed;
+  uint64_t _sequence;
 
 public:
 
 /// Default constructor
-  Domain(): _rank(0), _query_time_avg(0), _query_time_stddev(0), _query_count(0), _time_first(0), _time_last(0) {}
+  Domain(): _rank(0), _time_first(0), _time_last(0), _probe_interval(0), _dirty(false), _dropped(0), _table(nullptr), _id(0), _seed(0), _sequence(0) {}
   
-/// Constructor: ranks are automatically incremented by the db engine
-  Domain(const std::string& name, size_t rank = 0, double query_time_avg = 0, double query_time_stddev = 0, double query_count = 0, double time_first = 0, double time_last = 0) :
-    _rank(rank), _name(name), _query_time_avg(query_time_avg), 
-    _query_time_stddev(query_time_stddev), _query_count(query_count), 
-    _time_first(time_first), _time_last(time_last) {
+/// Constructor: ranks are automatically incremented by the db engine, a null probe interval stands for the vantage one
+  Domain(const std::string& name, size_t rank = 0, double query_time_avg = 0, double query_time_stddev = 0, double query_count = 0, double time_first = 0, double time_last = 0, Time probe_interval = 0) :
+    _rank(rank), _name(name), _query_time(query_count, query_time_avg, query_time_stddev), 
+    _time_first(time_first), _time_last(time_last), _probe_interval(probe_interval), _dirty(false), _dropped(0), _table(nullptr), _id(0), _seed(0), _sequence(0) {
     
-    // Log object creation
-    std::stringstream msg;
-    msg << "Domain " << _name << " constructed with q_tm_avg =" << query_time_avg << " q_tm_stddev =" << query_time_stddev 
-        << " q_count =" << query_count << " tm_first =" << time_first << " tm_last=" << time_last; 
-    Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    // Log object creation, formatting is costly for large inventories
+    if (Log::isEnabled(Log::LOG_DEBUG)) {
+      std::stringstream msg;
+      msg << "Domain " << _name << " constructed with q_tm_avg =" << query_time_avg << " q_tm_stddev =" << query_time_stddev 
+          << " q_count =" << query_count << " tm_first =" << time_first << " tm_last=" << time_last; 
+      Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    }
 
-    // Compute a hash value of the domain name
-    const char *p = _name.c_str();
-    unsigned char hash = 0;
-    for (;*p; hash ^= *p++); 
+    // Seed the labels with a FNV-1a hash of the domain name, the same across runs
+    _seed = 0xcbf29ce484222325ULL;
+    for (unsigned char c : _name) _seed = (_seed ^ c) * 0x100000001b3ULL;
 
-    // Seed the random number generator with this hash
-    _PRNG.seed(hash);
+    // Pre-encode the query packet
+    if (!_query.compile(_name))
+      Log::write("Domain " + _name + " is not a valid DNS name", Log::LOG_ERROR, __FUNCTION__, __LINE__); 
   }
  
   size_t getRank() const            { return _rank; }
   std::string getName() const       { return _name; }
-  double getQueryTimeAvg() const    { return _query_time_avg; }
-  double getQueryTimeStdDev() const { return _query_time_stddev; }
-  size_t getQueryCount() const      { return _query_count; }
-  Time getTimeFirst() const         { return _time_first; }
-  Time getTimeLast() const          { return _time_last; }
+  StreamingMoments getQueryTime() const { return _table ? _table->getMoments(_id) : _query_time; }
+  double getQueryTimeAvg() const    { return getQueryTime().getMean(); }
+  double getQueryTimeStdDev() const { return getQueryTime().getStdDev(); }
+  size_t getQueryCount() const      { return getQueryTime().getCount(); }
+  Time getTimeFirst() const         { return _table ? _table->getTimeFirst(_id) : _time_first; }
+  Time getTimeLast() const          { return _table ? _table->getTimeLast(_id) : _time_last; }
+  Time getProbeInterval() const     { return _probe_interval; }
+  bool isDirty() const              { return _table ? _table->getChanges(_id) & DomainTable::CHANGED_STATS : _dirty; }
+
+/// Mark the statistics as persisted
+  void setClean() { 
+    if (_table) _table->setClean(_id);
+    _dirty = false; 
+  }
+
+/// Whether the domain has anything to persist
+  bool hasChanges() const { return isDirty() || !_events.empty() || _sketch.getTotal(); }
+
+/// Move the statistics to a new row of the table, returns its id
+  size_t bind(DomainTable& table) {
+    detach();
+    _id = table.add(_query_time, _time_first, _time_last, (_dirty ? DomainTable::CHANGED_STATS : 0) | (_events.empty() ? 0 : DomainTable::CHANGED_EVENTS));
+    _table = &table;
+    return _id;
+  }
+
+/// Take the statistics back from the row, e.g. for a copy to outlive the table
+  void detach() {
+    if (!_table) return;
+    _query_time = _table->getMoments(_id);
+    _time_first = _table->getTimeFirst(_id);
+    _time_last  = _table->getTimeLast(_id);
+    _dirty      = _table->getChanges(_id) & DomainTable::CHANGED_STATS;
+    _table      = nullptr;
+  }
+
+/**
+* @brief Snapshot of what a save persists: the rank, the statistics and the sketch
+* The pending events and the sketch of the window move over, the name and the 
+* pre-encoded query stay behind.
+*/
+  Domain snapshot() {
+    Domain copy;
+    copy._rank           = _rank;
+    copy._query_time     = getQueryTime();
+    copy._time_first     = getTimeFirst();
+    copy._time_last      = getTimeLast();
+    copy._probe_interval = _probe_interval;
+    copy._dirty          = isDirty();
+    copy._dropped        = _dropped;
+    std::swap(copy._sketch, _sketch);
+    copy._events.swap(_events);
+    _dropped = 0;
+    return copy;
+  }
+
+/// Take the statistics of a snapshot of this domain and merge its window in the sketch
+  void restore(const Domain& snapshot) {
+    detach();
+    _query_time = snapshot.getQueryTime();
+    _time_first = snapshot.getTimeFirst();
+    _time_last  = snapshot.getTimeLast();
+    _sketch.merge(snapshot._sketch);
+    _dirty      = false;
+  }
 
 /// Give access to inner events  
   Events& getEvents() { return _events; }
+
+/// Events dropped since the last snapshot, or before this one was taken
+  size_t getDropped() const { return _dropped; }
+
+/// Give access to the pre-encoded query
+  QueryTemplate& getQuery() { return _query; }
+
+/// Give access to the distribution of the query times since the last snapshot
+  DDSketch& getSketch() { return _sketch; }
+  const DDSketch& getSketch() const { return _sketch; }
+
+/// Query time in ms under which a fraction of the queries since the last snapshot fall, e.g. 0.99 for p99.
+/// Only this window is kept in memory, quantiles over any range come from DBAccess::loadSketch().
+  double getQueryTimePercentile(double fraction) const { return _sketch.getPercentile(fraction); }
   
 /// Update with events
   bool update(const Event& event)  { 
 
-    // Save current event
+    // Save current event, the oldest go when the writer has turned the domain down for long
+    if (_events.size() >= DEFAULT_PENDING_EVENTS) {
+      _events.pop();
+      _dropped++;
+    }
     _events.push(event);
+
+    if (_table) {
+      if (!_table->update(_id, event)) return false;
+      _sketch.add(event.duration);
+      return true;
+    }
     
     if (event.event != EV_RECV_DATA) return false;
 
     // Update stats:
+    _dirty = true;
 
     if (!_time_first) _time_first = event.time;
     _time_last = event.time;
-      
-    double old_avg = _query_time_avg;
 
-    // Update the sum of times
-    _query_time_avg *= _query_count; 
-    _query_time_avg += event.duration; 
-
-     
-     // Calculate the current sum of squared times
-     double sqr_avg = old_avg * old_avg + _query_time_stddev * _query_time_stddev;
-     sqr_avg *=  _query_count; 
-     sqr_avg += event.duration * event.duration;
-
-    _query_count++;
-
-    //calculate the new mean and the quadratic mean
-    _query_time_avg /= _query_count;
-     sqr_avg /= _query_count;
-    
-      
-    // Calculate the biased stddev from the avg and the quadratic avg
-    // We do not apply the Bessel's correction to unbias the variance estimator.
-    // The unbiased version can be obtained if needed by multiplying the variance by (n/n-1)     
-     _query_time_stddev = sqr_avg - _query_time_avg * _query_time_avg;
-     _query_time_stddev = sqrt(_query_time_stddev);
+    // The standard deviation stays the biased one, see StreamingMoments to unbias it
+    _query_time.add(event.duration);
+    _sketch.add(event.duration);
 
     return true;
   }
 
-/// Create a random target in this domain
-  std::string getRandomTarget() { 
+/**
+* @brief Create a random label of 4 to QueryTemplate::MAX_LABEL chars, returns its length
+* A single 64-bit draw is split into the length and the base-36 characters,
+* 7 * 36^10 choices taking less than 55 bits.
+*/
+  size_t getRandomTarget(char* label) { 
     
-    // Generate random strings of variable lengths
-    std::string str;
-    for (int target_len = _random_length(_PRNG); target_len > 0; target_len--) {
-      unsigned char c = _random_char(_PRNG);
+    uint64_t draw = splitmix64(_seed + ++_sequence * 0x9e3779b97f4a7c15ULL);
+    size_t len = 4 + draw % (QueryTemplate::MAX_LABEL - 3);
+    draw /= QueryTemplate::MAX_LABEL - 3;
+
+    for (size_t i = 0; i < len; i++, draw /= 36) {
+      unsigned c = draw % 36;
       if (c < 26) 
-        str += 'a' + c;
+        label[i] = 'a' + c;
       else 
-        str += '0' + c - 26;
+        label[i] = '0' + c - 26;
     }
 
-    return str;
+    return len;
+  }
+
+/// Create a random target in this domain
+  std::string getRandomTarget() { 
+    char label[QueryTemplate::MAX_LABEL];
+    return std::string(label, getRandomTarget(label));
   }
 
   ~Domain() {}
@@ -187,6 +869,22 @@ public:
 typedef std::vector<Domain> Domains;
 
 //================================= Database =========================================//
+/**
+* @brief Fixed-width measurement record of the series store
+* Targets are kept as their random label, the domain name follows from the rank.
+*/
+struct SeriesRecord {
+  uint64_t time;
+  uint64_t rank;
+  double duration;
+  uint8_t type;
+  uint8_t label_length;
+  char label[QueryTemplate::MAX_LABEL];
+  uint8_t reserved[4];
+};
+
+static_assert(sizeof(SeriesRecord) == 40, "Series records are 40 bytes on disk");
+
 /**
 * @brief DBAccess abstract class
 */
@@ -205,6 +903,12 @@ public:
   virtual bool addDomains(Domains& domains)     = 0;
   virtual bool deleteDomains(Domains& domains)  = 0;
   virtual bool saveDomains(Domains& domains)    = 0;
+
+/// Merge the query time sketches of a domain over a window of UNIX times, of one vantage point if given. False when the backend keeps none.
+  virtual bool loadSketch(size_t /* rank */, Time /* from */, Time /* to */, DDSketch& /* sketch */, const std::string& /* vantage */ = "") { return false; }
+
+/// Aggregate measurements written outside the database, e.g. to a series store. True when the backend keeps no rollups.
+  virtual bool rollUp(const SeriesRecord* /* records */, size_t /* count */) { return true; }
 };
 
 /**
@@ -223,18 +927,61 @@ class MySQLAccess: public DBAccess {
 *   query_time_stddev DOUBLE, 
 *   query_count BIGINT, 
 *   time_first TIMESTAMP, 
-*   time_last TIMESTAMP
+*   time_last TIMESTAMP,
+*   probe_interval BIGINT DEFAULT 0, -- ms, 0 for the vantage interval
+*   INDEX (name)
 * );
 *
+* Databases created before per-domain intervals are upgraded with:
+* ALTER TABLE domain ADD COLUMN probe_interval BIGINT DEFAULT 0;
+* and before deletes by batches of names with:
+* ALTER TABLE domain ADD INDEX (name);
+*
 * CREATE TABLE measurement (
-*   ID BIGINT AUTO_INCREMENT PRIMARY KEY, 
-*   time TIMESTAMP, 
+*   ID BIGINT AUTO_INCREMENT, 
+*   time TIMESTAMP NOT NULL, 
 *   target VARCHAR(255) NOT NULL, 
 *   type INT, 
 *   duration_ms DOUBLE, 
 *   domain_rank BIGINT NOT NULL, 
-*   INDEX (domain_rank), 
-*   FOREIGN KEY (domain_rank) REFERENCES domain(rank) ON DELETE CASCADE ON UPDATE CASCADE
+*   PRIMARY KEY (ID, time),
+*   INDEX (domain_rank)
+* ) PARTITION BY RANGE (UNIX_TIMESTAMP(time)) (PARTITION pfuture VALUES LESS THAN MAXVALUE);
+*
+* Daily partitions are created ahead of time out of pfuture and dropped past 
+* the retention. Partitioned tables cannot have foreign keys, deletes remove 
+* measurements explicitly. Databases created before are upgraded with:
+* ALTER TABLE measurement DROP FOREIGN KEY measurement_ibfk_1, DROP PRIMARY KEY, 
+*   ADD PRIMARY KEY (ID, time), MODIFY time TIMESTAMP NOT NULL;
+* ALTER TABLE measurement PARTITION BY RANGE (UNIX_TIMESTAMP(time)) (PARTITION pfuture VALUES LESS THAN MAXVALUE);
+* A table left unpartitioned works as before, without retention.
+*
+* Per-minute and per-hour rollups are created on connection and updated by every flush,
+* minute rollups follow the retention:
+* CREATE TABLE measurement_minute (
+*   domain_rank BIGINT NOT NULL, 
+*   minute TIMESTAMP NOT NULL, 
+*   type INT NOT NULL, 
+*   count BIGINT, 
+*   duration_sum DOUBLE, 
+*   duration_sum2 DOUBLE, 
+*   duration_min DOUBLE, 
+*   duration_max DOUBLE,
+*   PRIMARY KEY (domain_rank, minute, type),
+*   INDEX (minute)
+* );
+* CREATE TABLE measurement_hour ( ... the same with hour ... );
+*
+* Query time sketches are appended by every flush, one row per domain with replies
+* since the previous one, and merged on read over any window and vantage points,
+* see loadSketch(). They follow the retention:
+* CREATE TABLE measurement_sketch (
+*   domain_rank BIGINT NOT NULL, 
+*   time TIMESTAMP NOT NULL, -- last reply of the window
+*   vantage VARCHAR(255) NOT NULL, -- host name
+*   query_time_histogram BLOB, -- DDSketch encoding
+*   INDEX (domain_rank, time),
+*   INDEX (time)
 * );
 * @endcode
 */
@@ -242,29 +989,549 @@ class MySQLAccess: public DBAccess {
 mysqlpp::Connection _connection;
 Domains _domains;
 
-public:
+/// Largest statement sent, kept below the max_allowed_packet of the server
+size_t _chunk_size;
 
-/// Constructor creates the connection object without establishing the connection to the database server
-  MySQLAccess(): _connection(bool(false)) {}
+/// Measurements are inserted by chunks of 2^MEASUREMENT_BITS rows at most
+static const unsigned MEASUREMENT_BITS = 8;
+static const unsigned MEASUREMENT_ROWS = 1 << MEASUREMENT_BITS;
 
-/// Connect to the database
-  bool connect(const char* dbname = 0, const char* username = 0, const char* password = 0) throw (std::runtime_error) { 
+/**
+* @brief Aggregate of the measurements of a domain and type over a minute or an hour
+*/
+struct Rollup {
+  size_t rank;
+  Time bucket;
+  int type;
+  size_t count;
+  double sum;
+  double sum2;
+  double min;
+  double max;
+};
 
-    if (dbname)   _dbname   = dbname; 
-    if (username) _username = username; 
-    if (username) _username = username; 
-    if (password) _password = password; 
-    
-    if (!_dbname.length()) {
-      const char * message = "Database name is required. Exiting..";
-      Log::write(message, Log::LOG_FATAL); 
-      throw std::runtime_error(message);
+/// Merge a measurement into the rollups of its domain, those from the first one on
+  static void accumulate(std::vector<Rollup>& rollups, size_t first, size_t rank, Time seconds, Time time, int type, double duration) {
+    Time bucket = time / seconds * seconds;
+    auto rollup = std::find_if(rollups.begin() + first, rollups.end(), [&](const Rollup& r) { return r.bucket == bucket && r.type == type; });
+    if (rollup == rollups.end()) {
+      rollups.push_back({rank, bucket, type, 0, 0, 0, duration, duration});
+      rollup = rollups.end() - 1;
     }
+    rollup->count++;
+    rollup->sum  += duration;
+    rollup->sum2 += duration * duration;
+    rollup->min   = std::min(rollup->min, duration);
+    rollup->max   = std::max(rollup->max, duration);
+  }
 
-    //Connect to the MySQL server using given credentials
-    if (!_connection.connect(dbname, DEFAULT_SERVER, username, password)) {
+  static void accumulate(std::vector<Rollup>& rollups, size_t first, size_t rank, Time seconds, const Event& event) {
+    accumulate(rollups, first, rank, seconds, event.time, event.event, event.duration);
+  }
 
-      std::stringstream msg;
+/// Aggregate the queued events by minute and by hour, they stay queued in order
+  static void rollUp(Domains& domains, std::vector<Rollup>& minutes, std::vector<Rollup>& hours) {
+    for (auto& domain : domains) {
+      size_t first_minute = minutes.size(), first_hour = hours.size();
+      Events& events = domain.getEvents();
+      for (size_t n = events.size(); n; n--) {
+        accumulate(minutes, first_minute, domain.getRank(), 60, events.front());
+        accumulate(hours, first_hour, domain.getRank(), 3600, events.front());
+        events.push(std::move(events.front()));
+        events.pop();
+      }
+    }
+  }
+
+/**
+* @brief Bound parameters of a measurement row
+*/
+struct MeasurementRow {
+  long long time;
+  char target[LDNS_MAX_DOMAINLEN + 1];
+  unsigned long target_length;
+  int type;
+  double duration;
+  long long rank;
+  size_t domain;
+};
+
+/// Prepared inserts of 2^k measurement rows, prepared on first use
+MYSQL_STMT* _measurement_stmts[MEASUREMENT_BITS + 1];
+
+// Parameters of one chunk, every statement binds a prefix of them
+std::vector<MeasurementRow> _measurement_rows;
+std::vector<MYSQL_BIND> _measurement_binds;
+
+/// Set the parameter bindings up once, they point to the rows of the chunk
+  void bindMeasurements() {
+
+    _measurement_rows.resize(MEASUREMENT_ROWS);
+    _measurement_binds.resize(MEASUREMENT_ROWS * 5);
+    memset(_measurement_binds.data(), 0, _measurement_binds.size() * sizeof(MYSQL_BIND));
+
+    for (unsigned i = 0; i < MEASUREMENT_ROWS; i++) {
+      MeasurementRow& row = _measurement_rows[i];
+      MYSQL_BIND* bind = &_measurement_binds[i * 5];
+
+      bind[0].buffer_type   = MYSQL_TYPE_LONGLONG;
+      bind[0].buffer        = &row.time;
+      bind[1].buffer_type   = MYSQL_TYPE_STRING;
+      bind[1].buffer        = row.target;
+      bind[1].buffer_length = sizeof(row.target);
+      bind[1].length        = &row.target_length;
+      bind[2].buffer_type   = MYSQL_TYPE_LONG;
+      bind[2].buffer        = &row.type;
+      bind[3].buffer_type   = MYSQL_TYPE_DOUBLE;
+      bind[3].buffer        = &row.duration;
+      bind[4].buffer_type   = MYSQL_TYPE_LONGLONG;
+      bind[4].buffer        = &row.rank;
+    }
+  }
+
+/// Get the prepared insert of 2^bits rows
+  MYSQL_STMT* getMeasurementStatement(unsigned bits) {
+
+    if (_measurement_stmts[bits]) return _measurement_stmts[bits];
+
+    std::string sql = "INSERT INTO measurement (time, target, type, duration_ms, domain_rank) VALUES ";
+    for (unsigned i = 0; i < 1u << bits; i++) 
+      sql += i ? ",(FROM_UNIXTIME(?),?,?,?,?)" : "(FROM_UNIXTIME(?),?,?,?,?)";
+
+    MYSQL_STMT* stmt = mysql_stmt_init(_connection.driver()->raw_connection());
+    if (!stmt || mysql_stmt_prepare(stmt, sql.c_str(), sql.length())) {
+      Log::write(std::string("Failed to prepare SQL statement: ") + (stmt ? mysql_stmt_error(stmt) : "out of memory"), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+      if (stmt) mysql_stmt_close(stmt);
+      return NULL;
+    }
+
+    return _measurement_stmts[bits] = stmt;
+  }
+
+/**
+* @brief Cursor feeding the queued events to LOAD DATA LOCAL INFILE as TSV rows
+* Rows are formatted while the client library reads them. Events are rotated 
+* through their queue rather than consumed, they only leave it once the 
+* statement succeeded so that a failed load can be inserted again.
+*/
+struct MeasurementStream {
+  Domains* domains;
+  size_t index;
+  size_t sent;
+  size_t count;
+  char row[2 * LDNS_MAX_DOMAINLEN + 128];
+  size_t length;
+  size_t offset;
+
+  MeasurementStream(Domains& domains): domains(&domains), index(0), sent(0), count(0), length(0), offset(0) {}
+
+/// Format the next event, returns false at the end
+  bool next() {
+
+    for (; index < domains->size(); index++, sent = 0) {
+      Domain& domain = (*domains)[index];
+      Events& events = domain.getEvents();
+      if (sent == events.size()) continue;
+
+      const Event& event = events.front();
+      length = snprintf(row, sizeof(row), "%lu\t", event.time);
+
+      // Escape the characters LOAD DATA interprets
+      for (char c : event.target) {
+        if (length + 2 >= sizeof(row) - 64) break;
+        if (c == '\\' || c == '\t' || c == '\n') row[length++] = '\\';
+        row[length++] = c;
+      }
+
+      length += snprintf(row + length, sizeof(row) - length, "\t%d\t%.9g\t%lu\n", int(event.event), event.duration, (unsigned long)domain.getRank());
+      offset = 0;
+      events.push(std::move(events.front()));
+      events.pop();
+      sent++;
+      count++;
+      return true;
+    }
+
+    return false;
+  }
+
+/// Put the queue streamed last back in order, then drop the streamed events if they were loaded
+  void finish(bool loaded) {
+
+    if (index < domains->size()) {
+      Events& events = (*domains)[index].getEvents();
+      for (size_t i = sent; i < events.size(); i++) {
+        events.push(std::move(events.front()));
+        events.pop();
+      }
+      if (loaded) for (; sent; sent--) events.pop();
+    }
+
+    if (loaded) for (size_t i = 0; i < std::min(index, domains->size()); i++) Events().swap((*domains)[i].getEvents());
+  }
+
+  static int init(void** ptr, const char* /* filename */, void* userdata) {
+    *ptr = userdata;
+    return 0;
+  }
+
+  static int read(void* ptr, char* buffer, unsigned int size) {
+    MeasurementStream* stream = (MeasurementStream*)ptr;
+    unsigned int done = 0;
+
+    while (done < size && (stream->offset < stream->length || stream->next())) {
+      size_t chunk = std::min(size_t(size - done), stream->length - stream->offset);
+      memcpy(buffer + done, stream->row + stream->offset, chunk);
+      stream->offset += chunk;
+      done += chunk;
+    }
+
+    return done;
+  }
+
+  static void end(void* /* ptr */) {}
+
+  static int error(void* /* ptr */, char* message, unsigned int size) {
+    snprintf(message, size, "Cannot stream measurements");
+    return 2000; // CR_UNKNOWN_ERROR
+  }
+};
+
+/// Measurements go through LOAD DATA LOCAL INFILE instead of inserts
+bool _bulk_load;
+
+/// Stream the queued events with LOAD DATA LOCAL INFILE and roll them up once loaded, returns the number of rows loaded, events left queued were not
+  size_t loadMeasurements(Domains& domains, std::vector<Rollup>& minutes, std::vector<Rollup>& hours) {
+
+    if (std::all_of(domains.begin(), domains.end(), [](Domain& domain) { return domain.getEvents().empty(); })) return 0;
+
+    MeasurementStream stream(domains);
+    MYSQL* connection = _connection.driver()->raw_connection();
+    mysql_set_local_infile_handler(connection, MeasurementStream::init, MeasurementStream::read, MeasurementStream::end, MeasurementStream::error, &stream);
+
+    bool loaded = execute("LOAD DATA LOCAL INFILE 'measurements' INTO TABLE measurement "
+                          "FIELDS TERMINATED BY '\\t' LINES TERMINATED BY '\\n' "
+                          "(@time, target, type, duration_ms, domain_rank) SET time = FROM_UNIXTIME(@time);");
+    mysql_set_local_infile_default(connection);
+
+    // A load reads every event
+    if (loaded) rollUp(domains, minutes, hours);
+    stream.finish(loaded);
+    if (loaded) return stream.count;
+
+    // The server may refuse local files, the statement is rolled back otherwise, either way every event goes to the inserts
+    if (!stream.count) {
+      Log::write("LOAD DATA LOCAL INFILE refused, falling back to inserts", Log::LOG_WARN, __FUNCTION__, __LINE__); 
+      _bulk_load = false;
+    } else {
+      std::stringstream msg;
+      msg << "LOAD DATA LOCAL INFILE failed after " << stream.count << " rows, inserting them instead";
+      Log::write(msg.str(), Log::LOG_WARN, __FUNCTION__, __LINE__); 
+    }
+
+    return 0;
+  }
+
+/**
+* @brief Insert the queued events through the binary protocol, one chunk of bound rows at a time
+* Inserted rows are rolled up, the events of the statements that failed go back 
+* to the queues of their domains. Returns the number of rows inserted.
+*/
+  size_t insertMeasurements(Domains& domains, std::vector<Rollup>& minutes, std::vector<Rollup>& hours) {
+
+    size_t rows = 0, count = 0;
+    for (size_t index = 0; index < domains.size(); index++) {
+      Domain& domain = domains[index];
+      Events& events = domain.getEvents();
+
+      // Events put back by a failed chunk are left for the next save
+      for (size_t n = events.size(); n; n--, events.pop()) {
+        const Event& event = events.front();
+        MeasurementRow& row = _measurement_rows[rows];
+
+        row.time          = event.time;
+        row.target_length = std::min(event.target.length(), sizeof(row.target));
+        memcpy(row.target, event.target.data(), row.target_length);
+        row.type          = event.event;
+        row.duration      = event.duration;
+        row.rank          = domain.getRank();
+        row.domain        = index;
+
+        if (++rows == MEASUREMENT_ROWS) {
+          count += executeMeasurements(rows, domains, minutes, hours);
+          rows = 0;
+        }
+      }
+    }
+    count += executeMeasurements(rows, domains, minutes, hours);
+
+    return count;
+  }
+
+/// Release the prepared statements, they belong to the connection
+  void closeMeasurementStatements() {
+    for (auto& stmt : _measurement_stmts) {
+      if (stmt) mysql_stmt_close(stmt);
+      stmt = NULL;
+    }
+  }
+
+/// Insert the first rows of the chunk with as few prepared statements as their binary decomposition, returns the number inserted
+  size_t executeMeasurements(size_t rows, Domains& domains, std::vector<Rollup>& minutes, std::vector<Rollup>& hours) {
+
+    size_t done = 0;
+
+    for (size_t first = 0; rows; ) {
+      unsigned bits = MEASUREMENT_BITS;
+      for (; !(rows >> bits); bits--);
+      size_t last = first + (size_t(1) << bits);
+
+      MYSQL_STMT* stmt = getMeasurementStatement(bits);
+      if (!stmt || mysql_stmt_bind_param(stmt, &_measurement_binds[first * 5]) || mysql_stmt_execute(stmt)) {
+        if (stmt) Log::write(std::string("Failed to insert measurements: ") + mysql_stmt_error(stmt), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+
+        for (size_t i = first; i < last; i++) {
+          const MeasurementRow& row = _measurement_rows[i];
+          domains[row.domain].getEvents().push({Time(row.time), std::string(row.target, row.target_length), EventType(row.type), row.duration});
+        }
+      } else {
+        // Rows of a domain follow each other
+        for (size_t i = first, first_minute = 0, first_hour = 0; i < last; i++) {
+          const MeasurementRow& row = _measurement_rows[i];
+          if (i == first || row.domain != _measurement_rows[i - 1].domain) {
+            first_minute = minutes.size();
+            first_hour = hours.size();
+          }
+          accumulate(minutes, first_minute, row.rank, 60, row.time, row.type, row.duration);
+          accumulate(hours, first_hour, row.rank, 3600, row.time, row.type, row.duration);
+        }
+        done += last - first;
+      }
+
+      first = last;
+      rows -= size_t(1) << bits;
+    }
+
+    return done;
+  }
+
+/// Write binary data as an SQL hexadecimal literal
+  static void writeBinary(std::ostream& sql, const std::string& data) {
+    static const char digits[] = "0123456789ABCDEF";
+    sql << "X'";
+    for (unsigned char c : data) sql << digits[c >> 4] << digits[c & 15];
+    sql << "'";
+  }
+
+/// Quote a string as an SQL literal, escaped for the character set of the connection
+  std::string quote(const std::string& value) {
+    std::string escaped(2 * value.length() + 1, '\0');
+    escaped.resize(mysql_real_escape_string(_connection.driver()->raw_connection(), &escaped[0], value.data(), value.length()));
+    return "'" + escaped + "'";
+  }
+
+/// Execute a statement that returns no rows
+  bool execute(const std::string& sql) {
+    unsigned long long rows;
+    return execute(sql, rows);
+  }
+
+/// Execute a statement and give the number of rows it affected
+  bool execute(const std::string& sql, unsigned long long& rows) {
+    mysqlpp::Query query = _connection.query(sql);
+    mysqlpp::SimpleResult result = query.execute();
+    rows = result ? result.rows() : 0;
+    if (! result) {
+      std::stringstream msg;
+      msg <<  "Failed to execute SQL statement: " << query.error();
+      Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+      return false;
+    }
+    return true;
+  }
+
+/// Days of measurements kept in the partitions, 0 keeps them all
+size_t _retention;
+
+/// Next partition maintenance, UNIX time
+time_t _maintenance_time;
+
+/// Whether the measurement table is partitioned by time, until told otherwise
+bool _partitioned;
+
+/// Vantage point the sketches are tagged with, the host name
+std::string _vantage;
+
+/// Add aggregates to a rollup table, merging them with those of the buckets already there
+  bool upsertRollups(const std::string& table, const std::string& column, const std::vector<Rollup>& rollups) {
+
+    const std::string insert = "INSERT INTO " + table + " (domain_rank, " + column + ", type, count, duration_sum, duration_sum2, duration_min, duration_max) VALUES \n";
+    const std::string update = " ON DUPLICATE KEY UPDATE count = count + VALUES(count), duration_sum = duration_sum + VALUES(duration_sum), "
+                               "duration_sum2 = duration_sum2 + VALUES(duration_sum2), duration_min = LEAST(duration_min, VALUES(duration_min)), "
+                               "duration_max = GREATEST(duration_max, VALUES(duration_max));";
+    std::stringstream sql;
+    sql.precision(17);
+    bool done = true;
+
+    for (const auto& rollup : rollups) {
+      if (sql.tellp() <= 0) sql << insert; else sql << ",";
+      sql << "(" << rollup.rank << ", FROM_UNIXTIME(" << rollup.bucket << ")," << rollup.type << "," << rollup.count << "," 
+          << rollup.sum << "," << rollup.sum2 << "," << rollup.min << "," << rollup.max << ")\n";
+
+      if (size_t(sql.tellp()) >= _chunk_size) {
+        sql << update;
+        done &= execute(sql.str());
+        sql.str("");
+      }
+    }
+
+    if (sql.tellp() > 0) {
+      sql << update;
+      done &= execute(sql.str());
+    }
+
+    return done;
+  }
+
+/// Append the sketch of the window of every domain with replies, the sketches written are reset
+  bool insertSketches(Domains& domains) {
+
+    const std::string insert = "INSERT INTO measurement_sketch (domain_rank, time, vantage, query_time_histogram) VALUES \n";
+    const std::string vantage = quote(_vantage);
+    std::stringstream sql;
+    size_t first = 0;
+    bool done = true;
+
+    // Domains of a statement are reset once it is executed
+    auto flush = [&](size_t last) {
+      sql << ";";
+      bool inserted = execute(sql.str());
+      for (; inserted && first < last; first++) domains[first].getSketch() = DDSketch();
+      done &= inserted;
+      sql.str("");
+    };
+
+    for (size_t index = 0; index < domains.size(); index++) {
+      const Domain& domain = domains[index];
+      if (!domain.getSketch().getTotal()) continue;
+
+      if (sql.tellp() <= 0) {
+        sql << insert;
+        first = index;
+      } else {
+        sql << ",";
+      }
+      sql << "(" << domain.getRank() << ", FROM_UNIXTIME(" << domain.getTimeLast() << ")," << vantage << ",";
+      writeBinary(sql, domain.getSketch().encode());
+      sql << ")\n";
+
+      if (size_t(sql.tellp()) >= _chunk_size) flush(index + 1);
+    }
+
+    if (sql.tellp() > 0) flush(domains.size());
+    return done;
+  }
+
+/**
+* @brief Keep daily partitions of the measurement table ahead of time and drop those past the retention
+* Runs at most every DEFAULT_MAINTENANCE_INTERVAL, a table that is not partitioned is left alone.
+*/
+  void maintainPartitions() {
+
+    const Time DAY = 86400;
+    time_t now = time(0);
+    if (now < _maintenance_time) return;
+    _maintenance_time = now + DEFAULT_MAINTENANCE_INTERVAL;
+
+    // Minute rollups and sketches go with the raw measurements, hourly rollups are kept
+    for (const char* table : {"measurement_minute", "measurement_sketch"}) {
+      if (!_retention) break;
+      std::stringstream purge;
+      purge << "DELETE FROM " << table << " WHERE " << (table == std::string("measurement_minute") ? "minute" : "time") << " < FROM_UNIXTIME(" 
+            << Time(now) - _retention * DAY << ") LIMIT " << DEFAULT_PURGE_BATCH << ";";
+      for (unsigned long long rows = DEFAULT_PURGE_BATCH; rows == DEFAULT_PURGE_BATCH; )
+        if (!execute(purge.str(), rows)) break;
+    }
+
+    if (!_partitioned) return;
+
+    mysqlpp::Query query = _connection.query("SELECT PARTITION_NAME, PARTITION_DESCRIPTION FROM information_schema.PARTITIONS "
+                                             "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = 'measurement' AND PARTITION_NAME IS NOT NULL;");
+    mysqlpp::StoreQueryResult results = query.store();
+    if (!results || !results.num_rows()) {
+      Log::write("The measurement table is not partitioned by time, partitions are not managed", Log::LOG_WARN, __FUNCTION__, __LINE__); 
+      _partitioned = false;
+      return;
+    }
+
+    std::string future, expired;
+    Time last = 0;
+    for (auto& row : results) {
+      std::string name(row[0].data(), row[0].length()), bound(row[1].data(), row[1].length());
+      if (bound == "MAXVALUE") {
+        future = name;
+        continue;
+      }
+      Time upper = strtoull(bound.c_str(), NULL, 10);
+      last = std::max(last, upper);
+      if (_retention && upper <= Time(now) - _retention * DAY) expired += (expired.empty() ? "" : ",") + name;
+    }
+
+    // One partition per day, named after it
+    std::stringstream partitions;
+    size_t created = 0;
+    Time today = Time(now) / DAY * DAY;
+    for (Time upper = std::max(last, today) + DAY; upper <= today + (DEFAULT_PARTITIONS_AHEAD + 1) * DAY; upper += DAY, created++) {
+      time_t day = upper - DAY;
+      struct tm date;
+      char name[16];
+      strftime(name, sizeof(name), "p%Y%m%d", gmtime_r(&day, &date));
+      partitions << (created ? ", " : "") << "PARTITION " << name << " VALUES LESS THAN (" << upper << ")";
+    }
+
+    if (created) {
+      if (future.length())
+        execute("ALTER TABLE measurement REORGANIZE PARTITION " + future + " INTO (" + partitions.str() + ", PARTITION " + future + " VALUES LESS THAN MAXVALUE);");
+      else
+        execute("ALTER TABLE measurement ADD PARTITION (" + partitions.str() + ");");
+    }
+    if (expired.length()) execute("ALTER TABLE measurement DROP PARTITION " + expired + ";");
+
+    std::stringstream msg;
+    msg << "Created " << created << " measurement partitions, dropped " << (expired.empty() ? 0 : std::count(expired.begin(), expired.end(), ',') + 1);
+    Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+  }
+
+public:
+
+/// Constructor creates the connection object without establishing the connection to the database server,
+/// bulk loads require local_infile on the server, measurement partitions older than the retention in days are dropped
+  MySQLAccess(bool bulk_load = false, size_t retention = 0): _connection(bool(false)), _chunk_size(DEFAULT_DB_CHUNK_SIZE), _measurement_stmts(), 
+    _bulk_load(bulk_load), _retention(retention), _maintenance_time(0), _partitioned(true) {
+    bindMeasurements();
+  }
+
+/// Connect to the database
+  bool connect(const char* dbname = 0, const char* username = 0, const char* password = 0) { 
+
+    if (dbname)   _dbname   = dbname; 
+    if (username) _username = username; 
+    if (username) _username = username; 
+    if (password) _password = password; 
+    
+    if (!_dbname.length()) {
+      const char * message = "Database name is required. Exiting..";
+      Log::write(message, Log::LOG_FATAL); 
+      throw std::runtime_error(message);
+    }
+
+    // Bulk loads stream measurements as a local file
+    if (_bulk_load) _connection.set_option(new mysqlpp::LocalFilesOption(true));
+
+    //Connect to the MySQL server using given credentials
+    if (!_connection.connect(dbname, DEFAULT_SERVER, username, password)) {
+
+      std::stringstream msg;
       msg <<  "Cannot connect to " <<  DEFAULT_SERVER << "." << _dbname << " as " << _username;
 
       Log::write(msg.str(), Log::LOG_FATAL, __FUNCTION__, __LINE__); 
@@ -273,11 +1540,40 @@ public:
     } 
         
     Log::write("Connected to " + _dbname + " as " + _username, Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+
+    // Leave room for the statement overhead of the server
+    mysqlpp::Query query = _connection.query("SELECT @@max_allowed_packet;");
+    if (mysqlpp::StoreQueryResult results = query.store()) {
+      if (results.size()) _chunk_size = std::min(DEFAULT_DB_CHUNK_SIZE, size_t(results[0][0]) / 2);
+    }
+    _chunk_size = std::max(_chunk_size, size_t(1 << 16));
+
+    // Session table staging the statistics of every flush
+    execute("CREATE TEMPORARY TABLE IF NOT EXISTS domain_stats ("
+            "rank BIGINT PRIMARY KEY, query_time_avg DOUBLE, query_time_stddev DOUBLE, query_count BIGINT, "
+            "time_first TIMESTAMP NULL, time_last TIMESTAMP NULL);");
+
+    // Sketches of every flush, tagged with the vantage point
+    execute("CREATE TABLE IF NOT EXISTS measurement_sketch (domain_rank BIGINT NOT NULL, time TIMESTAMP NOT NULL, vantage VARCHAR(255) NOT NULL, "
+            "query_time_histogram BLOB, INDEX (domain_rank, time), INDEX (time));");
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    _vantage = host;
+
+    // Rollups maintained by the flushes
+    for (const char* bucket : {"minute", "hour"}) {
+      execute(std::string("CREATE TABLE IF NOT EXISTS measurement_") + bucket + " (domain_rank BIGINT NOT NULL, " + bucket + " TIMESTAMP NOT NULL, "
+              "type INT NOT NULL, count BIGINT, duration_sum DOUBLE, duration_sum2 DOUBLE, duration_min DOUBLE, duration_max DOUBLE, "
+              "PRIMARY KEY (domain_rank, " + bucket + ", type), INDEX (" + bucket + "));");
+    }
+
+    maintainPartitions();
     return true;
   }
   
 /// Disconnect from the database
   bool disconnect() {
+    closeMeasurementStatements();
     _connection.disconnect(); 
     Log::write("Disconnected from " + _dbname, Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
     return true;
@@ -285,316 +1581,3520 @@ public:
 
   }
 
-/// Load domains
+/**
+* @brief Load domains
+* Rows are fetched one at a time into a table reserved beforehand, 
+* the result set is never held in memory as a whole.
+*/
   bool loadDomains(Domains& domains) {
-    std::string sql = "SELECT rank, name, query_time_avg, query_time_stddev, query_count, UNIX_TIMESTAMP(time_first), UNIX_TIMESTAMP(time_last) FROM domain;";
+
+    // Reserve the table to build domains in place
+    if (mysqlpp::StoreQueryResult count = _connection.query("SELECT COUNT(*) FROM domain;").store()) 
+      if (count.num_rows()) domains.reserve(domains.size() + size_t(count[0][0]));
+
+    std::string sql = "SELECT rank, name, query_time_avg, query_time_stddev, query_count, UNIX_TIMESTAMP(time_first), UNIX_TIMESTAMP(time_last), IFNULL(probe_interval, 0) FROM domain;";
 
     // Execute the SQL statement
     mysqlpp::Query query = _connection.query(sql);
     Log::write("Loading domains with query " + sql, Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
 
-    if (mysqlpp::StoreQueryResult results = query.store()) {
-      for ( auto& row : results ) {
-        domains.push_back(Domain(std::string(row[1]), size_t(row[0]), double(row[2]), double(row[3]), size_t(row[4]), size_t(row[5]), size_t(row[6])));
+    if (mysqlpp::UseQueryResult results = query.use()) {
+      while (mysqlpp::Row row = results.fetch_row()) {
+        domains.emplace_back(std::string(row[1].data(), row[1].length()), size_t(row[0]), double(row[2]), double(row[3]), size_t(row[4]), size_t(row[5]), size_t(row[6]), Time(row[7]));
       }
-          
-    } else {
+
+      // The end of the rows and a broken fetch look the same
+      if (!query.errnum()) return true;
+    }
       
+    std::stringstream msg;
+    msg <<  "Failed to execute SQL statement: " << query.error();
+    Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    return false;
+  }
+
+/// Add domains with as few multi-row inserts as the packet size allows
+  bool addDomains(Domains& domains)  {
+
+    if (!domains.size()) return false; 
+
+    const std::string insert = "INSERT INTO domain (name, query_time_avg, query_time_stddev, query_count, time_first, time_last, probe_interval) VALUES \n";
+    std::stringstream sql;
+    bool added = true;
+
+    for (const auto& domain : domains){
+      if (sql.tellp() <= 0) sql << insert; else sql << ","; 
+      sql << "(" << quote(domain.getName()) << "," << domain.getQueryTimeAvg() << "," << domain.getQueryTimeStdDev() << ","
+          << domain.getQueryCount() << ", FROM_UNIXTIME("  << domain.getTimeFirst() << "), FROM_UNIXTIME(" << domain.getTimeLast() << "), " << domain.getProbeInterval() << ")\n";
+
+      if (size_t(sql.tellp()) >= _chunk_size) {
+        sql << ";";
+        added &= execute(sql.str());
+        sql.str("");
+      }
+    }
+
+    if (sql.tellp() > 0) {
+      sql << ";";
+      added &= execute(sql.str());
+    }
+
+    std::stringstream msg;
+    msg << "Inserted " << domains.size() << " domains";
+    Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+
+    return added;
+  }
+
+/**
+* @brief Delete domains by batches of names, their measurements first
+* Measurements and their rollups go by bounded deletes that each hold their 
+* locks briefly, then the domains go.
+*/
+  bool deleteDomains(Domains& domains) {
+
+    if (!domains.size()) return false; 
+
+    bool deleted = true;
+    unsigned long long count = 0, measurements = 0;
+
+    for (size_t first = 0, last; first < domains.size(); first = last) {
+
+      std::stringstream names;
+      for (last = first; last < domains.size() && last - first < DEFAULT_DELETE_BATCH && size_t(names.tellp()) < _chunk_size; last++)
+        names << (last > first ? "," : "") << quote(domains[last].getName());
+
+      // Ranks of the batch
+      mysqlpp::Query query = _connection.query("SELECT rank FROM domain WHERE name IN (" + names.str() + ");");
+      mysqlpp::StoreQueryResult results = query.store();
+      if (!results) {
+        std::stringstream msg;
+        msg <<  "Failed to execute SQL statement: " << query.error();
+        Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+        deleted = false;
+        continue;
+      }
+      if (!results.num_rows()) continue;
+
+      std::stringstream ranks;
+      for (auto& row : results) ranks << (ranks.tellp() > 0 ? "," : "") << size_t(row[0]);
+
+      bool purged = true;
+      for (const char* table : {"measurement", "measurement_minute", "measurement_hour", "measurement_sketch"}) {
+        std::stringstream purge;
+        purge << "DELETE FROM " << table << " WHERE domain_rank IN (" << ranks.str() << ") LIMIT " << DEFAULT_PURGE_BATCH << ";";
+        for (unsigned long long rows = DEFAULT_PURGE_BATCH; rows == DEFAULT_PURGE_BATCH; measurements += table == std::string("measurement") ? rows : 0) {
+          if (!execute(purge.str(), rows)) {
+            purged = false;
+            break;
+          }
+        }
+      }
+
+      // Domains stay while rows refer to them, so that the delete can be retried by name
+      if (!purged) {
+        deleted = false;
+        continue;
+      }
+
+      unsigned long long rows = 0;
+      deleted &= execute("DELETE FROM domain WHERE rank IN (" + ranks.str() + ");", rows);
+      count += rows;
+    }
+
+    std::stringstream msg;
+    msg << "Deleted " << count << " domains and " << measurements << " measurements";
+    Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+
+    return deleted;
+  }
+
+/**
+* @brief Merge the sketches of a domain over a window of UNIX times
+* Every vantage point is merged unless one is given.
+*/
+  bool loadSketch(size_t rank, Time from, Time to, DDSketch& sketch, const std::string& vantage = "") {
+
+    std::stringstream sql;
+    sql << "SELECT query_time_histogram FROM measurement_sketch WHERE domain_rank = " << rank 
+        << " AND time BETWEEN FROM_UNIXTIME(" << from << ") AND FROM_UNIXTIME(" << to << ")";
+    if (vantage.length()) sql << " AND vantage = " << quote(vantage);
+    sql << ";";
+
+    mysqlpp::Query query = _connection.query(sql.str());
+    if (mysqlpp::UseQueryResult results = query.use()) {
+      while (mysqlpp::Row row = results.fetch_row()) {
+        DDSketch window;
+        if (!row[0].is_null() && window.decode(row[0].data(), row[0].length()) && !sketch.merge(window))
+          Log::write("Sketches of different accuracies are not merged", Log::LOG_WARN, __FUNCTION__, __LINE__); 
+      }
+
+      if (!query.errnum()) return true;
+    }
+
+    std::stringstream msg;
+    msg <<  "Failed to execute SQL statement: " << query.error();
+    Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    return false;
+  }
+
+ /// Update domains and insert measurements, what could not be written stays with the domains and false is returned
+  bool saveDomains(Domains& domains) {
+
+    if (!domains.size()) return false; 
+
+    maintainPartitions();
+  
+    // Stage the statistics of the dirty domains with as few multi-row inserts as the packet size 
+    // allows, then update the domains with a single join. Domains deleted meanwhile are not revived.
+    const std::string insert = "INSERT INTO domain_stats VALUES \n";
+    std::stringstream stats;
+    size_t dirty = 0;
+    bool staged = true, updated = true;
+
+    for (auto& domain : domains) {
+      if (!domain.isDirty()) continue;
+
+      if (stats.tellp() <= 0) stats << insert; else stats << ","; 
+      stats << "(" << domain.getRank() << "," << domain.getQueryTimeAvg() << "," << domain.getQueryTimeStdDev() << "," 
+          << domain.getQueryCount() << ", FROM_UNIXTIME("  << domain.getTimeFirst() << "), FROM_UNIXTIME(" << domain.getTimeLast() << "))\n";
+      dirty++;
+
+      if (size_t(stats.tellp()) >= _chunk_size) {
+        stats << ";";
+        staged &= execute(stats.str());
+        stats.str("");
+      }
+    }
+
+    if (stats.tellp() > 0) {
+      stats << ";";
+      staged &= execute(stats.str());
+    }
+
+    if (dirty) {
       std::stringstream msg;
-      msg <<  "Failed to execute SQL statement: " << query.error();
-      Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+      msg << "Updating " << dirty << " dirty domains from staged statistics";
+      Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+
+      updated = staged && execute("UPDATE domain d JOIN domain_stats s ON d.rank = s.rank SET d.query_time_avg = s.query_time_avg, "
+                                  "d.query_time_stddev = s.query_time_stddev, d.query_count = s.query_count, d.time_first = s.time_first, d.time_last = s.time_last;");
+      if (updated) 
+        for (auto& domain : domains) domain.setClean();
+      execute("DELETE FROM domain_stats;");
+    }
+
+    bool sketched = insertSketches(domains);
+
+    // Insert measurements, in bulk when enabled, and roll up those inserted
+    std::vector<Rollup> minutes, hours;
+    size_t count = 0;
+    if (_bulk_load) count += loadMeasurements(domains, minutes, hours);
+    count += insertMeasurements(domains, minutes, hours);
+
+    bool rolled = true;
+    if (minutes.size()) {
+      rolled &= upsertRollups("measurement_minute", "minute", minutes);
+      rolled &= upsertRollups("measurement_hour", "hour", hours);
+    }
+
+    std::stringstream msg;
+    msg << "Inserted " << count << " measurements";
+    Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+
+    // Measurements left queued were not inserted, rollups that failed cannot be replayed without counting the rows twice
+    return updated && sketched && rolled && std::all_of(domains.begin(), domains.end(), [](Domain& domain) { return domain.getEvents().empty(); });
+  }
+
+/// Add the measurements of a series store to the rollups, the records of a domain follow each other
+  bool rollUp(const SeriesRecord* records, size_t count) {
+
+    std::vector<Rollup> minutes, hours;
+    for (size_t i = 0, first_minute = 0, first_hour = 0; i < count; i++) {
+      const SeriesRecord& record = records[i];
+      if (i && record.rank != records[i - 1].rank) {
+        first_minute = minutes.size();
+        first_hour = hours.size();
+      }
+      accumulate(minutes, first_minute, record.rank, 60, record.time, record.type, record.duration);
+      accumulate(hours, first_hour, record.rank, 3600, record.time, record.type, record.duration);
+    }
+
+    if (!minutes.size()) return true;
+    bool minuted = upsertRollups("measurement_minute", "minute", minutes);
+    return upsertRollups("measurement_hour", "hour", hours) && minuted;
+  }
+};
+
+/**
+* @brief SQLite Access implementation class
+* The database is a single file created on first use, so a vantage point 
+* needs no database server. The journal is written ahead so that the writer
+* thread does not lock readers out, and every flush is one transaction.
+*/
+class SQLiteAccess: public DBAccess {
+
+/**
+* @brief Database creation code, run on connection
+* @code
+* CREATE TABLE IF NOT EXISTS domain (
+*   rank INTEGER PRIMARY KEY AUTOINCREMENT, 
+*   name TEXT NOT NULL, 
+*   query_time_avg REAL, 
+*   query_time_stddev REAL, 
+*   query_count INTEGER, 
+*   time_first INTEGER, -- UNIX time
+*   time_last INTEGER, 
+*   probe_interval INTEGER DEFAULT 0
+* );
+*
+* CREATE TABLE IF NOT EXISTS measurement (
+*   ID INTEGER PRIMARY KEY, 
+*   time INTEGER, 
+*   target TEXT NOT NULL, 
+*   type INTEGER, 
+*   duration_ms REAL, 
+*   domain_rank INTEGER NOT NULL REFERENCES domain(rank) ON DELETE CASCADE ON UPDATE CASCADE
+* );
+* CREATE INDEX IF NOT EXISTS measurement_domain_rank ON measurement (domain_rank);
+* CREATE INDEX IF NOT EXISTS domain_name ON domain (name);
+*
+* -- Query time sketches of every flush, merged on read, see loadSketch()
+* CREATE TABLE IF NOT EXISTS measurement_sketch (
+*   domain_rank INTEGER NOT NULL REFERENCES domain(rank) ON DELETE CASCADE ON UPDATE CASCADE, 
+*   time INTEGER, -- last reply of the window
+*   vantage TEXT NOT NULL, 
+*   query_time_histogram BLOB
+* );
+* CREATE INDEX IF NOT EXISTS measurement_sketch_domain_rank ON measurement_sketch (domain_rank, time);
+* @endcode
+*/
+
+sqlite3* _connection;
+
+// Prepared statements
+sqlite3_stmt* _load_stmt;
+sqlite3_stmt* _add_stmt;
+sqlite3_stmt* _delete_stmt;
+sqlite3_stmt* _update_stmt;
+sqlite3_stmt* _measurement_stmt;
+sqlite3_stmt* _sketch_stmt;
+sqlite3_stmt* _load_sketch_stmt;
+
+/// Bounded deletes of the measurements and the sketches of a domain by name
+sqlite3_stmt* _purge_stmts[2];
+
+/// Vantage point the sketches are tagged with, the host name
+std::string _vantage;
+
+/// Log the last error of the connection
+  void error(const std::string& what) {
+    Log::write("Failed to " + what + ": " + sqlite3_errmsg(_connection), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+  }
+
+/// Execute statements that return no rows
+  bool execute(const char* sql) {
+    if (sqlite3_exec(_connection, sql, NULL, NULL, NULL) != SQLITE_OK) {
+      error(std::string("execute SQL statement ") + sql);
+      return false;
+    }
+    return true;
+  }
+
+  sqlite3_stmt* prepare(const char* sql) {
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(_connection, sql, -1, &stmt, NULL) != SQLITE_OK) 
+      error(std::string("prepare SQL statement ") + sql);
+    return stmt;
+  }
+
+/// Run a prepared statement once with the bound parameters and reset it
+  bool step(sqlite3_stmt* stmt) {
+    int status = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (status != SQLITE_DONE) {
+      error("execute a prepared statement");
+      return false;
+    }
+    return true;
+  }
+
+/// Run the domain bindings of a statement in one transaction
+  bool transaction(Domains& domains, const std::function<bool(Domain&)>& bind) {
+    return transaction(domains.begin(), domains.end(), bind);
+  }
+
+  bool transaction(Domains::iterator first, Domains::iterator last, const std::function<bool(Domain&)>& bind) {
+    if (!execute("BEGIN;")) return false;
+
+    bool done = true;
+    for (; first != last; ++first) done &= bind(*first);
+
+    return execute(done ? "COMMIT;" : "ROLLBACK;") && done;
+  }
+
+  void finalize() {
+    for (sqlite3_stmt** stmt : {&_load_stmt, &_add_stmt, &_delete_stmt, &_update_stmt, &_measurement_stmt, &_sketch_stmt, &_load_sketch_stmt, &_purge_stmts[0], &_purge_stmts[1]}) {
+      sqlite3_finalize(*stmt);
+      *stmt = NULL;
+    }
+  }
+
+public:
+
+/// Constructor does not open the database file
+  SQLiteAccess(): _connection(NULL), _load_stmt(NULL), _add_stmt(NULL), _delete_stmt(NULL), _update_stmt(NULL), _measurement_stmt(NULL), 
+    _sketch_stmt(NULL), _load_sketch_stmt(NULL), _purge_stmts() {}
+
+/// Open the database file given as database name, it is created with its schema if needed. Credentials are ignored.
+  bool connect(const char* dbname = 0, const char* /* username */ = 0, const char* /* password */ = 0) { 
+
+    if (dbname) _dbname = dbname; 
+    
+    if (!_dbname.length()) {
+      const char * message = "Database file is required. Exiting..";
+      Log::write(message, Log::LOG_FATAL); 
+      throw std::runtime_error(message);
+    }
+
+    if (sqlite3_open(_dbname.c_str(), &_connection) != SQLITE_OK) {
+      std::string message = "Cannot open " + _dbname + ": " + sqlite3_errmsg(_connection);
+      Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      sqlite3_close(_connection);
+      _connection = NULL;
+      throw std::runtime_error(message);
+    }
+
+    // Readers are not blocked by the writer and commits do not wait for the disk
+    execute("PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL; PRAGMA foreign_keys = ON;");
+    sqlite3_busy_timeout(_connection, 5000);
+
+    execute("CREATE TABLE IF NOT EXISTS domain (rank INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, "
+            "query_time_avg REAL, query_time_stddev REAL, query_count INTEGER, time_first INTEGER, time_last INTEGER, probe_interval INTEGER DEFAULT 0);"
+            "CREATE TABLE IF NOT EXISTS measurement (ID INTEGER PRIMARY KEY, time INTEGER, target TEXT NOT NULL, type INTEGER, duration_ms REAL, "
+            "domain_rank INTEGER NOT NULL REFERENCES domain(rank) ON DELETE CASCADE ON UPDATE CASCADE);"
+            "CREATE INDEX IF NOT EXISTS measurement_domain_rank ON measurement (domain_rank);"
+            "CREATE INDEX IF NOT EXISTS domain_name ON domain (name);"
+            "CREATE TABLE IF NOT EXISTS measurement_sketch (domain_rank INTEGER NOT NULL REFERENCES domain(rank) ON DELETE CASCADE ON UPDATE CASCADE, "
+            "time INTEGER, vantage TEXT NOT NULL, query_time_histogram BLOB);"
+            "CREATE INDEX IF NOT EXISTS measurement_sketch_domain_rank ON measurement_sketch (domain_rank, time);");
+
+    _load_stmt        = prepare("SELECT rank, name, query_time_avg, query_time_stddev, query_count, time_first, time_last, IFNULL(probe_interval, 0) FROM domain;");
+    _add_stmt         = prepare("INSERT INTO domain (name, query_time_avg, query_time_stddev, query_count, time_first, time_last, probe_interval) VALUES (?, ?, ?, ?, ?, ?, ?);");
+    _delete_stmt      = prepare("DELETE FROM domain WHERE name = ?;");
+    _update_stmt      = prepare("UPDATE domain SET query_time_avg = ?, query_time_stddev = ?, query_count = ?, time_first = ?, time_last = ? WHERE rank = ?;");
+    _measurement_stmt = prepare("INSERT INTO measurement (time, target, type, duration_ms, domain_rank) VALUES (?, ?, ?, ?, ?);");
+    _sketch_stmt      = prepare("INSERT INTO measurement_sketch (domain_rank, time, vantage, query_time_histogram) VALUES (?, ?, ?, ?);");
+    _load_sketch_stmt = prepare("SELECT query_time_histogram FROM measurement_sketch WHERE domain_rank = ? AND time BETWEEN ? AND ? AND (? = '' OR vantage = ?);");
+    _purge_stmts[0]   = prepare("DELETE FROM measurement WHERE rowid IN (SELECT rowid FROM measurement WHERE domain_rank = (SELECT rank FROM domain WHERE name = ?) LIMIT ?);");
+    _purge_stmts[1]   = prepare("DELETE FROM measurement_sketch WHERE rowid IN (SELECT rowid FROM measurement_sketch WHERE domain_rank = (SELECT rank FROM domain WHERE name = ?) LIMIT ?);");
+
+    if (!_load_stmt || !_add_stmt || !_delete_stmt || !_update_stmt || !_measurement_stmt || !_sketch_stmt || !_load_sketch_stmt || !_purge_stmts[0] || !_purge_stmts[1]) {
+      std::string message = "Cannot prepare the statements of " + _dbname;
+      Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      disconnect();
+      throw std::runtime_error(message);
+    }
+
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    _vantage = host;
+
+    Log::write("Opened " + _dbname, Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    return true;
+  }
+  
+/// Close the database file
+  bool disconnect() {
+    if (!_connection) return false;
+
+    finalize();
+    sqlite3_close(_connection); 
+    _connection = NULL;
+    Log::write("Closed " + _dbname, Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    return true;
+  }
+
+/// Load domains
+  bool loadDomains(Domains& domains) {
+
+    int status;
+    while ((status = sqlite3_step(_load_stmt)) == SQLITE_ROW) {
+      domains.push_back(Domain((const char*)sqlite3_column_text(_load_stmt, 1), sqlite3_column_int64(_load_stmt, 0), 
+                               sqlite3_column_double(_load_stmt, 2), sqlite3_column_double(_load_stmt, 3), sqlite3_column_int64(_load_stmt, 4), 
+                               sqlite3_column_int64(_load_stmt, 5), sqlite3_column_int64(_load_stmt, 6), sqlite3_column_int64(_load_stmt, 7)));
+    }
+    sqlite3_reset(_load_stmt);
+
+    if (status != SQLITE_DONE) {
+      error("load domains");
+      return false;
+    }
+    return true;
+  }
+
+/// Add domains
+  bool addDomains(Domains& domains)  {
+
+    if (!domains.size()) return false; 
+
+    return transaction(domains, [this](Domain& domain) {
+      sqlite3_bind_text(_add_stmt, 1, domain.getName().c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_double(_add_stmt, 2, domain.getQueryTimeAvg());
+      sqlite3_bind_double(_add_stmt, 3, domain.getQueryTimeStdDev());
+      sqlite3_bind_int64(_add_stmt, 4, domain.getQueryCount());
+      sqlite3_bind_int64(_add_stmt, 5, domain.getTimeFirst());
+      sqlite3_bind_int64(_add_stmt, 6, domain.getTimeLast());
+      sqlite3_bind_int64(_add_stmt, 7, domain.getProbeInterval());
+      return step(_add_stmt);
+    });
+  }
+
+/**
+* @brief Purge the measurements and sketches of domains by transactions of DEFAULT_PURGE_BATCH rows at most
+* Returns false when a purge fails, what it deleted is rolled back.
+*/
+  bool purge(Domains::iterator first, Domains::iterator last) {
+
+    size_t budget = 0;
+    for (; first != last; ++first)
+      for (sqlite3_stmt* stmt : _purge_stmts)
+        for (;;) {
+          if (!budget) {
+            if (!execute("BEGIN;")) return false;
+            budget = DEFAULT_PURGE_BATCH;
+          }
+
+          sqlite3_bind_text(stmt, 1, first->getName().c_str(), -1, SQLITE_TRANSIENT);
+          sqlite3_bind_int64(stmt, 2, budget);
+          if (!step(stmt)) {
+            execute("ROLLBACK;");
+            return false;
+          }
+
+          // A full batch may leave rows behind, they go in the next transaction
+          size_t rows = sqlite3_changes(_connection);
+          size_t limit = budget;
+          budget -= rows;
+          if (!budget && !execute("COMMIT;")) return false;
+          if (rows < limit) break;
+        }
+
+    return !budget || execute("COMMIT;");
+  }
+
+/// Delete domains by batches, their measurements first by bounded transactions, to let writers in between
+  bool deleteDomains(Domains& domains) {
+
+    if (!domains.size()) return false; 
+
+    bool deleted = true;
+    for (size_t first = 0; first < domains.size(); first += DEFAULT_DELETE_BATCH) {
+
+      // Domains stay while a purge fails, the cascade would delete the rest at once
+      if (!purge(domains.begin() + first, domains.begin() + std::min(domains.size(), first + DEFAULT_DELETE_BATCH))) {
+        deleted = false;
+        continue;
+      }
+
+      deleted &= transaction(domains.begin() + first, domains.begin() + std::min(domains.size(), first + DEFAULT_DELETE_BATCH), [this](Domain& domain) {
+        sqlite3_bind_text(_delete_stmt, 1, domain.getName().c_str(), -1, SQLITE_TRANSIENT);
+        return step(_delete_stmt);
+      });
+    }
+    return deleted;
+  }
+
+/// Update the dirty domains and insert measurements in one transaction, nothing is consumed if it fails
+  bool saveDomains(Domains& domains) {
+
+    if (!domains.size()) return false; 
+
+    size_t count = 0;
+    bool saved = transaction(domains, [this, &count](Domain& domain) {
+      bool done = true;
+
+      if (domain.isDirty()) {
+        sqlite3_bind_double(_update_stmt, 1, domain.getQueryTimeAvg());
+        sqlite3_bind_double(_update_stmt, 2, domain.getQueryTimeStdDev());
+        sqlite3_bind_int64(_update_stmt, 3, domain.getQueryCount());
+        sqlite3_bind_int64(_update_stmt, 4, domain.getTimeFirst());
+        sqlite3_bind_int64(_update_stmt, 5, domain.getTimeLast());
+        sqlite3_bind_int64(_update_stmt, 6, domain.getRank());
+        done &= step(_update_stmt);
+      }
+
+      if (domain.getSketch().getTotal()) {
+        std::string histogram = domain.getSketch().encode();
+        sqlite3_bind_int64(_sketch_stmt, 1, domain.getRank());
+        sqlite3_bind_int64(_sketch_stmt, 2, domain.getTimeLast());
+        sqlite3_bind_text(_sketch_stmt, 3, _vantage.data(), _vantage.length(), SQLITE_STATIC);
+        sqlite3_bind_blob(_sketch_stmt, 4, histogram.data(), histogram.size(), SQLITE_TRANSIENT);
+        done &= step(_sketch_stmt);
+      }
+
+      // Events are rotated through their queue, they only leave it once committed
+      Events& events = domain.getEvents();
+      for (size_t n = events.size(); n; n--, count++) {
+        const Event& event = events.front();
+        sqlite3_bind_int64(_measurement_stmt, 1, event.time);
+        sqlite3_bind_text(_measurement_stmt, 2, event.target.data(), event.target.length(), SQLITE_STATIC);
+        sqlite3_bind_int(_measurement_stmt, 3, event.event);
+        sqlite3_bind_double(_measurement_stmt, 4, event.duration);
+        sqlite3_bind_int64(_measurement_stmt, 5, domain.getRank());
+        done &= step(_measurement_stmt);
+        events.push(std::move(events.front()));
+        events.pop();
+      }
+
+      return done;
+    });
+
+    // A transaction rolled back leaves everything to save again
+    if (saved) {
+      for (auto& domain : domains) {
+        domain.setClean();
+        Events().swap(domain.getEvents());
+        domain.getSketch() = DDSketch();
+      }
+    }
+
+    std::stringstream msg;
+    msg << "Inserted " << count << " measurements";
+    Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+
+    return saved;
+  }
+
+/// Merge the sketches of a domain over a window of UNIX times, of every vantage point unless one is given
+  bool loadSketch(size_t rank, Time from, Time to, DDSketch& sketch, const std::string& vantage = "") {
+
+    sqlite3_bind_int64(_load_sketch_stmt, 1, rank);
+    sqlite3_bind_int64(_load_sketch_stmt, 2, from);
+    sqlite3_bind_int64(_load_sketch_stmt, 3, to);
+    sqlite3_bind_text(_load_sketch_stmt, 4, vantage.data(), vantage.length(), SQLITE_STATIC);
+    sqlite3_bind_text(_load_sketch_stmt, 5, vantage.data(), vantage.length(), SQLITE_STATIC);
+
+    int status;
+    while ((status = sqlite3_step(_load_sketch_stmt)) == SQLITE_ROW) {
+      DDSketch window;
+      if (sqlite3_column_type(_load_sketch_stmt, 0) == SQLITE_BLOB && 
+          window.decode((const char*)sqlite3_column_blob(_load_sketch_stmt, 0), sqlite3_column_bytes(_load_sketch_stmt, 0)) && !sketch.merge(window))
+        Log::write("Sketches of different accuracies are not merged", Log::LOG_WARN, __FUNCTION__, __LINE__); 
+    }
+    sqlite3_reset(_load_sketch_stmt);
+    sqlite3_clear_bindings(_load_sketch_stmt);
+
+    if (status != SQLITE_DONE) {
+      error("load sketches");
+      return false;
+    }
+    return true;
+  }
+
+  ~SQLiteAccess() { disconnect(); }
+};
+
+/**
+* @brief Records received by the benchmark backends
+*/
+struct AccessStats {
+  size_t saves;
+  size_t domains;
+  size_t events;
+  size_t added;
+  size_t deleted;
+};
+
+/**
+* @brief Backend throwing measurements and statistics away, to benchmark the probe path
+* The domain inventory is kept in memory so that added domains get probed.
+*/
+class NullAccess: public DBAccess {
+
+protected:
+
+  Domains _domains;
+  size_t _next_rank;
+  AccessStats _stats;
+  std::mutex _mutex;
+
+/// Count and consume what a save hands over
+  void receive(Domains& domains, std::function<void(Domain&, Events&)> keep) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats.saves++;
+    for (auto& domain : domains) {
+      if (!domain.hasChanges()) continue;
+      Events events;
+      events.swap(domain.getEvents());
+      _stats.domains++;
+      _stats.events += events.size();
+      keep(domain, events);
+      domain.setClean();
+    }
+  }
+
+public:
+
+  NullAccess(): _next_rank(1) { memset(&_stats, 0, sizeof(_stats)); }
+
+  bool connect(const char* /* dbname */ = 0, const char* /* username */ = 0, const char* /* password */ = 0) { 
+    Log::write("Using an in-process backend, nothing is persisted", Log::LOG_INFO, __FUNCTION__, __LINE__); 
+    return true;
+  }
+
+/// Report what was received
+  bool disconnect() {
+    AccessStats stats = getStats();
+    std::stringstream msg;
+    msg << "Received " << stats.domains << " domains and " << stats.events << " events in " << stats.saves << " saves, " 
+        << stats.added << " domains added, " << stats.deleted << " deleted";
+    Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+    return true;
+  }
+
+  bool loadDomains(Domains& domains) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    domains.insert(domains.end(), _domains.begin(), _domains.end());
+    return true;
+  }
+
+/// Add domains, ranks are given in order of insertion
+  bool addDomains(Domains& domains) {
+    if (!domains.size()) return false; 
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto& domain : domains) {
+      _domains.push_back(Domain(domain.getName(), _next_rank++, domain.getQueryTimeAvg(), domain.getQueryTimeStdDev(), domain.getQueryCount(), 
+                                domain.getTimeFirst(), domain.getTimeLast(), domain.getProbeInterval()));
+      _stats.added++;
+    }
+    return true;
+  }
+
+  bool deleteDomains(Domains& domains) {
+    if (!domains.size()) return false; 
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto& domain : domains) {
+      size_t size = _domains.size();
+      _domains.erase(std::remove_if(_domains.begin(), _domains.end(), [&domain](const Domain& stored) { return stored.getName() == domain.getName(); }), 
+                     _domains.end());
+      _stats.deleted += size - _domains.size();
+    }
+    return true;
+  }
+
+  bool saveDomains(Domains& domains) {
+    if (!domains.size()) return false; 
+
+    receive(domains, [](Domain&, Events&) {});
+    return true;
+  }
+
+  AccessStats getStats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+  }
+};
+
+/**
+* @brief Backend keeping statistics and measurements in memory
+* Measurements are kept with the rank of their domain.
+*/
+class InMemoryAccess: public NullAccess {
+
+  std::vector<std::pair<size_t, Event> > _measurements;
+
+public:
+
+/// Update the statistics of the stored domains and keep their measurements
+  bool saveDomains(Domains& domains) {
+    if (!domains.size()) return false; 
+
+    // Stored domains stay in rank order, as ranks are given in order of insertion
+    receive(domains, [this](Domain& domain, Events& events) {
+      auto found = std::lower_bound(_domains.begin(), _domains.end(), domain.getRank(), [](const Domain& stored, size_t rank) { return stored.getRank() < rank; });
+      if (found != _domains.end() && found->getRank() == domain.getRank()) found->restore(domain);
+
+      for (; !events.empty(); events.pop()) _measurements.push_back(std::make_pair(domain.getRank(), events.front()));
+    });
+    return true;
+  }
+
+/// Copy of the measurements received so far
+  std::vector<std::pair<size_t, Event> > getMeasurements() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _measurements;
+  }
+};
+
+/**
+* @brief Streams domain names into a database, skipping those already there
+* Names are normalized then checked against a hash set of the known names,
+* new ones are added in batches of a fixed number of domains.
+*/
+class DomainImporter {
+
+  DBAccess& _dbaccess;
+  Time _probe_interval;
+  size_t _batch_size;
+  std::unordered_set<std::string> _names;
+  Domains _batch;
+  size_t _added;
+  size_t _duplicates;
+  size_t _invalid;
+
+public:
+
+/// Imported domains get the given probe interval, 0 for the vantage one
+  DomainImporter(DBAccess& dbaccess, Time probe_interval = 0, size_t batch_size = DEFAULT_IMPORT_BATCH): 
+    _dbaccess(dbaccess), _probe_interval(probe_interval), _batch_size(std::max(batch_size, size_t(1))), _added(0), _duplicates(0), _invalid(0) {}
+
+/**
+* @brief Normalize a domain name in place: trimmed, lowercase, without the root dot
+* Lines of top-sites lists as "rank,name" give their last field. 
+* Returns false for names that are not valid DNS names.
+*/
+  static bool normalize(std::string& name) {
+
+    size_t comma = name.rfind(',');
+    size_t first = comma == std::string::npos ? 0 : comma + 1;
+    while (first < name.length() && isspace((unsigned char)name[first])) first++;
+    size_t last = name.length();
+    while (last > first && isspace((unsigned char)name[last - 1])) last--;
+    if (last > first && name[last - 1] == '.') last--;
+    name = name.substr(first, last - first);
+
+    if (name.empty() || name.length() > 253) return false;
+
+    size_t label = 0;
+    for (auto& c : name) {
+      c = tolower((unsigned char)c);
+      if (c == '.') {
+        if (!label) return false;
+        label = 0;
+      } else if ((isalnum((unsigned char)c) || c == '-' || c == '_') && ++label <= 63) {
+        continue;
+      } else {
+        return false;
+      }
+    }
+    return label;
+  }
+
+/// Remember the names already in the database
+  bool load() {
+    Domains domains;
+    if (!_dbaccess.loadDomains(domains)) return false;
+
+    _names.reserve(domains.size());
+    for (const auto& domain : domains) _names.insert(domain.getName());
+    return true;
+  }
+
+/// Queue a domain unless it is invalid or known, returns true if queued
+  bool add(std::string name) {
+
+    if (!normalize(name)) {
+      Log::write("Invalid domain name " + name, Log::LOG_WARN, __FUNCTION__, __LINE__); 
+      _invalid++;
+      return false;
+    }
+
+    if (!_names.insert(name).second) {
+      if (Log::isEnabled(Log::LOG_DEBUG)) Log::write("Domain " + name + " already in database.", Log::LOG_DEBUG, __FUNCTION__, __LINE__);
+      _duplicates++;
+      return false;
+    }
+
+    _batch.emplace_back(name, 0, 0, 0, 0, 0, 0, _probe_interval);
+    if (_batch.size() >= _batch_size) flush();
+    return true;
+  }
+
+/// Import a name per line, lines starting with # are comments
+  size_t import(std::istream& input) {
+    size_t added = _added + _batch.size();
+    std::string line;
+    while (std::getline(input, line)) {
+      size_t start = line.find_first_not_of(" \t\r");
+      if (start == std::string::npos || line[start] == '#') continue;
+      add(line);
+    }
+    flush();
+    return _added - added;
+  }
+
+/// Add the queued domains
+  bool flush() {
+    if (_batch.empty()) return true;
+
+    bool added = _dbaccess.addDomains(_batch);
+    if (added) _added += _batch.size();
+
+    std::stringstream msg;
+    msg << (added ? "Added " : "Failed to add ") << _batch.size() << " domains, " << _added << " so far";
+    Log::write(msg.str(), added ? Log::LOG_DEBUG : Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+
+    _batch.clear();
+    return added;
+  }
+
+  size_t getAdded() const      { return _added; }
+  size_t getDuplicates() const { return _duplicates; }
+  size_t getInvalid() const    { return _invalid; }
+
+  ~DomainImporter() { flush(); }
+};
+
+/**
+* @brief Bit stream writer, most significant bits first
+*/
+class BitWriter {
+
+  std::vector<uint8_t>& _out;
+  uint64_t _acc;
+  unsigned _count;
+
+public:
+
+  BitWriter(std::vector<uint8_t>& out): _out(out), _acc(0), _count(0) {}
+
+/// Append the low bits of a value
+  void write(uint64_t value, unsigned bits) {
+    if (bits > 32) {
+      write(value >> 32, bits - 32);
+      bits = 32;
+    }
+    if (!bits) return;
+
+    _acc = (_acc << bits) | (value & ((uint64_t(1) << bits) - 1));
+    _count += bits;
+    while (_count >= 8) {
+      _count -= 8;
+      _out.push_back(uint8_t(_acc >> _count));
+    }
+    _acc &= (uint64_t(1) << _count) - 1;
+  }
+
+/// Elias gamma code of a positive integer
+  void writeGamma(uint64_t value) {
+    unsigned bits = 64 - __builtin_clzll(value);
+    write(0, bits - 1);
+    write(value, bits);
+  }
+
+/// Pad the last byte
+  void flush() {
+    if (_count) _out.push_back(uint8_t(_acc << (8 - _count)));
+    _acc = _count = 0;
+  }
+};
+
+/**
+* @brief Bit stream reader, reading past the end yields zeros
+*/
+class BitReader {
+
+  const uint8_t* _data;
+  size_t _size;
+  size_t _position;
+
+public:
+
+  BitReader(const uint8_t* data, size_t size): _data(data), _size(size), _position(0) {}
+
+  uint64_t read(unsigned bits) {
+    if (bits > 32) {
+      uint64_t high = read(bits - 32);
+      return (high << 32) | read(32);
+    }
+    if (!bits) return 0;
+
+    // Load the 8 bytes holding the bits, big-endian
+    size_t byte = _position >> 3;
+    uint64_t word = 0;
+    if (byte + 8 <= _size) {
+      memcpy(&word, _data + byte, 8);
+      word = __builtin_bswap64(word);
+    } else {
+      for (size_t i = 0; i < 8; i++) word = (word << 8) | (byte + i < _size ? _data[byte + i] : 0);
+    }
+
+    uint64_t value = (word << (_position & 7)) >> (64 - bits);
+    _position += bits;
+    return value;
+  }
+
+  bool readBit() { return read(1); }
+
+  uint64_t readGamma() {
+    unsigned zeros = 0;
+    while (!readBit() && zeros < 63) zeros++;
+    return (uint64_t(1) << zeros) | read(zeros);
+  }
+
+  bool isOver() const { return _position > _size * 8; }
+};
+
+/**
+* @brief Columnar compressed encoding of series records
+* Every field is a separate bit stream:
+* - ranks: dictionary of the distinct ranks and runs of dictionary indexes
+* - times: delta-of-delta in variable-length buckets along the rank runs, mostly one bit per record
+* - types: bitpacked on the width of the largest type
+* - durations: quantized to the microsecond and XOR-encoded against the previous one
+* - labels, optional: 4-bit length and 6-bit characters
+* Durations below the microsecond are lost, everything else is lossless.
+*/
+class ColumnarSegment {
+
+public:
+
+  enum { COLUMN_RANK, COLUMN_TIME, COLUMN_TYPE, COLUMN_DURATION, COLUMN_LABEL, COLUMNS };
+
+  static const uint32_t FLAG_LABELS = 1;
+
+/**
+* @brief Header of an encoded segment, followed by the columns
+*/
+  struct Header {
+    char magic[8];
+    uint64_t count;
+    uint64_t time_min;
+    uint64_t time_max;
+    uint64_t rank_min;
+    uint64_t rank_max;
+    uint32_t flags;
+    uint32_t type_bits;
+    uint64_t offsets[COLUMNS + 1];
+  };
+
+private:
+
+  static uint64_t zigzag(int64_t value)   { return (uint64_t(value) << 1) ^ uint64_t(value >> 63); }
+  static int64_t unzigzag(uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
+
+  static int64_t quantize(double duration) { return llround(duration * 1e+3); }
+
+/// Label characters on 6 bits, others are escaped
+  static unsigned encodeChar(char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= '0' && c <= '9') return 26 + c - '0';
+    if (c == '-') return 36;
+    return 63;
+  }
+
+  static char decodeChar(unsigned code) {
+    if (code < 26) return 'a' + code;
+    if (code < 36) return '0' + code - 26;
+    return '-';
+  }
+
+/// Zigzag value in buckets of 0, 7, 9, 12 or 64 bits
+  static void writeBucket(BitWriter& out, int64_t value) {
+    uint64_t bits = zigzag(value);
+    if (!bits)               out.write(0, 1);
+    else if (bits < 1 << 7)  { out.write(2, 2);  out.write(bits, 7); }
+    else if (bits < 1 << 9)  { out.write(6, 3);  out.write(bits, 9); }
+    else if (bits < 1 << 12) { out.write(14, 4); out.write(bits, 12); }
+    else                     { out.write(15, 4); out.write(bits, 64); }
+  }
+
+  static int64_t readBucket(BitReader& in) {
+    unsigned bits = 0;
+    if (in.readBit()) {
+      if (!in.readBit())      bits = 7;
+      else if (!in.readBit()) bits = 9;
+      else if (!in.readBit()) bits = 12;
+      else                    bits = 64;
+    }
+    return unzigzag(in.read(bits));
+  }
+
+/**
+* @brief Times follow the rank runs: a run starts with its offset to the previous run start,
+* the next records carry the delta-of-delta of the times within the run
+*/
+  static void encodeTimes(const SeriesRecord* records, size_t count, BitWriter& out) {
+    uint64_t start = 0;
+    int64_t delta = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (!i || records[i].rank != records[i - 1].rank) {
+        writeBucket(out, int64_t(records[i].time - start));
+        start = records[i].time;
+        continue;
+      }
+      // Differences wrap around like the times do
+      int64_t next = int64_t(records[i].time - records[i - 1].time);
+      writeBucket(out, int64_t(uint64_t(next) - uint64_t(delta)));
+      delta = next;
+    }
+  }
+
+/// Ranks are decoded first
+  static void decodeTimes(BitReader& in, SeriesRecord* records, size_t count) {
+    uint64_t start = 0;
+    int64_t delta = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (!i || records[i].rank != records[i - 1].rank) {
+        records[i].time = start += readBucket(in);
+        continue;
+      }
+      delta = int64_t(uint64_t(delta) + uint64_t(readBucket(in)));
+      records[i].time = records[i - 1].time + delta;
+    }
+  }
+
+  static void encodeRanks(const SeriesRecord* records, size_t count, BitWriter& out) {
+    std::vector<uint64_t> dictionary(count);
+    for (size_t i = 0; i < count; i++) dictionary[i] = records[i].rank;
+    std::sort(dictionary.begin(), dictionary.end());
+    dictionary.erase(std::unique(dictionary.begin(), dictionary.end()), dictionary.end());
+
+    out.write(dictionary.size(), 64);
+    out.write(dictionary[0], 64);
+    for (size_t i = 1; i < dictionary.size(); i++) out.writeGamma(dictionary[i] - dictionary[i - 1]);
+
+    unsigned bits = 64 - __builtin_clzll(dictionary.size());
+    for (size_t first = 0, last; first < count; first = last) {
+      for (last = first + 1; last < count && records[last].rank == records[first].rank; last++);
+      out.write(std::lower_bound(dictionary.begin(), dictionary.end(), records[first].rank) - dictionary.begin(), bits);
+      out.writeGamma(last - first);
+    }
+  }
+
+  static void decodeRanks(BitReader& in, SeriesRecord* records, size_t count) {
+    std::vector<uint64_t> dictionary(std::min(count, size_t(in.read(64))));
+    if (dictionary.empty()) return;
+    dictionary[0] = in.read(64);
+    for (size_t i = 1; i < dictionary.size(); i++) dictionary[i] = dictionary[i - 1] + in.readGamma();
+
+    unsigned bits = 64 - __builtin_clzll(dictionary.size());
+    for (size_t first = 0; first < count && !in.isOver(); ) {
+      uint64_t rank = dictionary[std::min(size_t(in.read(bits)), dictionary.size() - 1)];
+      for (size_t last = std::min(count, first + in.readGamma()); first < last; first++) records[first].rank = rank;
+    }
+  }
+
+  static void encodeDurations(const SeriesRecord* records, size_t count, BitWriter& out) {
+    uint64_t previous = 0;
+    unsigned leading = 64, trailing = 64;
+
+    for (size_t i = 0; i < count; i++) {
+      uint64_t value = quantize(records[i].duration);
+      uint64_t x = value ^ previous;
+      previous = value;
+
+      if (!x) {
+        out.write(0, 1);
+        continue;
+      }
+
+      unsigned lead = __builtin_clzll(x), trail = __builtin_ctzll(x);
+      if (leading + trailing < 64 && lead >= leading && trail >= trailing) {
+        // Meaningful bits within the previous window
+        out.write(2, 2);
+        out.write(x >> trailing, 64 - leading - trailing);
+      } else {
+        out.write(3, 2);
+        out.write(lead, 6);
+        out.write(63 - lead - trail, 6);
+        out.write(x >> trail, 64 - lead - trail);
+        leading = lead;
+        trailing = trail;
+      }
+    }
+  }
+
+  static void decodeDurations(BitReader& in, SeriesRecord* records, size_t count) {
+    uint64_t previous = 0;
+    unsigned leading = 0, trailing = 0;
+
+    for (size_t i = 0; i < count; i++) {
+      if (in.readBit()) {
+        if (in.readBit()) {
+          // The window stays within 64 bits whatever a corrupt stream holds
+          leading  = in.read(6);
+          trailing = 64 - leading - std::min(unsigned(in.read(6)) + 1, 64 - leading);
+        }
+        previous ^= in.read(64 - leading - trailing) << trailing;
+      }
+      records[i].duration = int64_t(previous) / 1e+3;
+    }
+  }
+
+  static void encodeLabels(const SeriesRecord* records, size_t count, BitWriter& out) {
+    for (size_t i = 0; i < count; i++) {
+      out.write(records[i].label_length, 4);
+      for (unsigned j = 0; j < records[i].label_length; j++) {
+        unsigned code = encodeChar(records[i].label[j]);
+        out.write(code, 6);
+        if (code == 63) out.write(uint8_t(records[i].label[j]), 8);
+      }
+    }
+  }
+
+  static void decodeLabels(BitReader& in, SeriesRecord* records, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      records[i].label_length = std::min(size_t(in.read(4)), sizeof(records[i].label));
+      for (unsigned j = 0; j < records[i].label_length; j++) {
+        unsigned code = in.read(6);
+        records[i].label[j] = code == 63 ? char(in.read(8)) : decodeChar(code);
+      }
+    }
+  }
+
+public:
+
+/// Encode records, labels are kept on demand
+  static void encode(const SeriesRecord* records, size_t count, bool labels, std::vector<uint8_t>& out) {
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "DNSPCOL1", sizeof(header.magic));
+    header.count    = count;
+    header.flags    = labels ? FLAG_LABELS : 0;
+    header.time_min = header.rank_min = UINT64_MAX;
+
+    uint8_t type_max = 0;
+    for (size_t i = 0; i < count; i++) {
+      header.time_min = std::min(header.time_min, records[i].time);
+      header.time_max = std::max(header.time_max, records[i].time);
+      header.rank_min = std::min(header.rank_min, records[i].rank);
+      header.rank_max = std::max(header.rank_max, records[i].rank);
+      type_max = std::max(type_max, records[i].type);
+    }
+    header.type_bits = 32 - __builtin_clz(type_max | 1);
+
+    out.assign(sizeof(header), 0);
+    for (unsigned column = 0; column < COLUMNS; column++) {
+      header.offsets[column] = out.size();
+      if (!count) continue;
+
+      BitWriter writer(out);
+      switch (column) {
+        case COLUMN_TIME:     encodeTimes(records, count, writer); break;
+        case COLUMN_RANK:     encodeRanks(records, count, writer); break;
+        case COLUMN_DURATION: encodeDurations(records, count, writer); break;
+        case COLUMN_LABEL:    if (labels) encodeLabels(records, count, writer); break;
+        case COLUMN_TYPE:
+          for (size_t i = 0; i < count; i++) writer.write(records[i].type, header.type_bits);
+          break;
+      }
+      writer.flush();
+    }
+    header.offsets[COLUMNS] = out.size();
+
+    memcpy(out.data(), &header, sizeof(header));
+  }
+
+/// Decode an encoded segment, returns false if it is corrupt
+  static bool decode(const uint8_t* data, size_t size, std::vector<SeriesRecord>& records) {
+
+    Header header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "DNSPCOL1", sizeof(header.magic)) || header.offsets[COLUMNS] != size || header.type_bits > 8) return false;
+    for (unsigned column = 0; column < COLUMNS; column++) 
+      if (header.offsets[column] > header.offsets[column + 1]) return false;
+
+    // Every record takes at least a bit of times, which bounds the count before allocating
+    if (header.count > (header.offsets[COLUMN_TIME + 1] - header.offsets[COLUMN_TIME]) * 8) return false;
+
+    records.resize(header.count);
+    if (!header.count) return true;
+    memset(records.data(), 0, records.size() * sizeof(SeriesRecord));
+
+    for (unsigned column = 0; column < COLUMNS; column++) {
+      BitReader reader(data + header.offsets[column], header.offsets[column + 1] - header.offsets[column]);
+      SeriesRecord* out = records.data();
+      switch (column) {
+        case COLUMN_TIME:     decodeTimes(reader, out, header.count); break;
+        case COLUMN_RANK:     decodeRanks(reader, out, header.count); break;
+        case COLUMN_DURATION: decodeDurations(reader, out, header.count); break;
+        case COLUMN_LABEL:    if (header.flags & FLAG_LABELS) decodeLabels(reader, out, header.count); break;
+        case COLUMN_TYPE:
+          for (size_t i = 0; i < header.count; i++) out[i].type = reader.read(header.type_bits);
+          break;
+      }
+      if (reader.isOver()) return false;
+    }
+
+    return true;
+  }
+};
+
+/**
+* @brief Append-only store of measurements in memory-mapped segment files
+* A segment holds a header, a sparse index with the time and rank bounds of
+* every block of records, then the records. Records are copied into the 
+* mapping as they come and the record count is published last, so readers 
+* never see a partial record. Scans skip segments and blocks out of range.
+* Full segments are compacted into columnar files, decoded when scanned.
+*/
+class SeriesStore {
+
+public:
+
+  static const size_t BLOCK_RECORDS = 1024;
+
+/**
+* @brief Bounds of a block of records
+*/
+  struct BlockIndex {
+    uint64_t time_min;
+    uint64_t time_max;
+    uint64_t rank_min;
+    uint64_t rank_max;
+  };
+
+/**
+* @brief Segment file header
+*/
+  struct SegmentHeader {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t time_min;
+    uint64_t time_max;
+  };
+
+  typedef std::function<void(const SeriesRecord&)> Visitor;
+
+  /// Told of every run of records appended to a segment, once they are written
+  typedef std::function<void(const SeriesRecord*, size_t)> Appended;
+
+private:
+
+/**
+* @brief Mapped segment file
+*/
+  struct Segment {
+    int fd;
+    void* map;
+    size_t size;
+    SegmentHeader* header;
+    BlockIndex* index;
+    SeriesRecord* records;
+
+    Segment(): fd(-1), map(MAP_FAILED), size(0), header(NULL), index(NULL), records(NULL) {}
+
+    static size_t layout(size_t capacity) {
+      return sizeof(SegmentHeader) + capacity / BLOCK_RECORDS * sizeof(BlockIndex) + capacity * sizeof(SeriesRecord);
+    }
+
+/// Map a segment file, a writable one is created with the given capacity if needed
+    bool open(const std::string& path, size_t capacity, bool writable) {
+
+      fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+      struct stat st;
+      if (fd < 0 || fstat(fd, &st) < 0) return close(), false;
+
+      bool created = writable && !st.st_size;
+      size = created ? layout(capacity) : st.st_size;
+      if (created && ftruncate(fd, size) < 0) return close(), false;
+
+      map = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED || size < sizeof(SegmentHeader)) return close(), false;
+
+      header = (SegmentHeader*)map;
+      if (created) {
+        memcpy(header->magic, "DNSPSEG1", sizeof(header->magic));
+        header->capacity = capacity;
+        header->count    = 0;
+        header->time_min = UINT64_MAX;
+        header->time_max = 0;
+      }
+      if (memcmp(header->magic, "DNSPSEG1", sizeof(header->magic)) || layout(header->capacity) != size) return close(), false;
+
+      index   = (BlockIndex*)(header + 1);
+      records = (SeriesRecord*)(index + header->capacity / BLOCK_RECORDS);
+      return true;
+    }
+
+    bool isOpen() const { return map != MAP_FAILED; }
+    bool isFull() const { return header->count == header->capacity; }
+
+    void close() {
+      if (map != MAP_FAILED) munmap(map, size);
+      if (fd >= 0) ::close(fd);
+      fd = -1;
+      map = MAP_FAILED;
+    }
+  };
+
+  std::string _directory;
+  size_t _capacity;
+  bool _keep_labels;
+  Segment _active;
+  uint64_t _sequence;
+
+  std::string getPath(uint64_t sequence, const char* extension = "dps") const {
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%010lu.%s", (unsigned long)sequence, extension);
+    return _directory + "/" + name;
+  }
+
+/// Sequence numbers of the segments in the directory in order, true for the compacted ones
+  std::vector<std::pair<uint64_t, bool> > getSequences() const {
+    std::map<uint64_t, bool> sequences;
+    if (DIR* dir = opendir(_directory.c_str())) {
+      unsigned long sequence;
+      char extension[4];
+      while (struct dirent* entry = readdir(dir)) 
+        if (sscanf(entry->d_name, "segment-%lu.%3s", &sequence, extension) == 2) {
+          if (!strcmp(extension, "dpc")) sequences[sequence] = true;
+          else if (!strcmp(extension, "dps")) sequences.insert(std::make_pair(sequence, false));
+        }
+      closedir(dir);
+    }
+    return std::vector<std::pair<uint64_t, bool> >(sequences.begin(), sequences.end());
+  }
+
+/// Replace a full segment by its columnar encoding
+  bool compact(uint64_t sequence) {
+
+    std::string path = getPath(sequence), compacted = getPath(sequence, "dpc"), temporary = compacted + ".tmp";
+
+    Segment segment;
+    if (!segment.open(path, 0, false)) return false;
+
+    std::vector<uint8_t> data;
+    ColumnarSegment::encode(segment.records, segment.header->count, _keep_labels, data);
+    size_t size = segment.size;
+    segment.close();
+
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool written = fd >= 0 && write(fd, data.data(), data.size()) == ssize_t(data.size()) && !fsync(fd);
+    if (fd >= 0) ::close(fd);
+    if (!written || rename(temporary.c_str(), compacted.c_str()) < 0) {
+      Log::write("Cannot compact segment " + path + ": " + strerror(errno), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+      unlink(temporary.c_str());
+      return false;
+    }
+    unlink(path.c_str());
+
+    std::stringstream message;
+    message << "Compacted segment " << sequence << " from " << size << " to " << data.size() << " bytes";
+    Log::write(message.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__);
+    return true;
+  }
+
+/// Start the next segment, the full one is compacted
+  bool roll() {
+    bool full = _active.isOpen() && _active.isFull();
+    _active.close();
+    if (full) compact(_sequence);
+    if (_active.open(getPath(++_sequence), _capacity, true)) return true;
+
+    Log::write("Cannot create segment " + getPath(_sequence) + ": " + strerror(errno), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    return false;
+  }
+
+public:
+
+/// Capacity in records of the segments to be created, and whether compaction keeps the labels
+  SeriesStore(size_t capacity = DEFAULT_SEGMENT_SIZE, bool keep_labels = true): 
+    _capacity(std::max(size_t(BLOCK_RECORDS), capacity / BLOCK_RECORDS * BLOCK_RECORDS)), _keep_labels(keep_labels), _sequence(0) {}
+
+/// Open a store directory, created if needed, appends resume in its last segment
+  bool open(const std::string& directory) {
+
+    _directory = directory;
+    if (mkdir(_directory.c_str(), 0755) < 0 && errno != EEXIST) {
+      Log::write("Cannot create store " + _directory + ": " + strerror(errno), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+      return false;
+    }
+
+    std::vector<std::pair<uint64_t, bool> > sequences = getSequences();
+    if (sequences.empty()) return roll();
+
+    // Finish the compactions interrupted by a stop
+    for (size_t i = 0; i + 1 < sequences.size(); i++) {
+      if (sequences[i].second) unlink(getPath(sequences[i].first).c_str());
+      else compact(sequences[i].first);
+    }
+
+    _sequence = sequences.back().first;
+    if (sequences.back().second) return roll();
+    if (_active.open(getPath(_sequence), _capacity, true)) return true;
+
+    Log::write("Cannot open segment " + getPath(_sequence) + ", starting a new one", Log::LOG_WARN, __FUNCTION__, __LINE__); 
+    return roll();
+  }
+
+  void close() {
+    if (_active.isOpen()) msync(_active.map, _active.size, MS_ASYNC);
+    _active.close();
+  }
+
+/**
+* @brief Move the pending events of the domains into the store
+* Returns false when a segment cannot be created, the remaining events stay with their domains.
+*/
+  bool append(Domains& domains, const Appended& appended = Appended()) {
+
+    if (!_active.isOpen()) return false;
+
+    SegmentHeader* header = _active.header;
+    uint64_t first = header->count, count = first;
+
+    for (auto& domain : domains) {
+      for (Events& events = domain.getEvents(); !events.empty(); events.pop()) {
+
+        if (count == header->capacity) {
+          __atomic_store_n(&header->count, count, __ATOMIC_RELEASE);
+          if (appended && count > first) appended(_active.records + first, count - first);
+          if (!roll()) return false;
+          header = _active.header;
+          first = count = 0;
+        }
+
+        const Event& event = events.front();
+        SeriesRecord& record = _active.records[count];
+        size_t label_length = std::min(event.target.find('.'), sizeof(record.label));
+
+        record.time         = event.time;
+        record.rank         = domain.getRank();
+        record.duration     = event.duration;
+        record.type         = event.event;
+        record.label_length = std::min(label_length, event.target.length());
+        memcpy(record.label, event.target.data(), record.label_length);
+
+        BlockIndex& block = _active.index[count / BLOCK_RECORDS];
+        if (!(count % BLOCK_RECORDS)) {
+          block.time_min = block.time_max = record.time;
+          block.rank_min = block.rank_max = record.rank;
+        } else {
+          block.time_min = std::min(block.time_min, record.time);
+          block.time_max = std::max(block.time_max, record.time);
+          block.rank_min = std::min(block.rank_min, record.rank);
+          block.rank_max = std::max(block.rank_max, record.rank);
+        }
+        header->time_min = std::min(header->time_min, record.time);
+        header->time_max = std::max(header->time_max, record.time);
+        count++;
+      }
+    }
+
+    // Publish the records at once
+    __atomic_store_n(&header->count, count, __ATOMIC_RELEASE);
+    if (appended && count > first) appended(_active.records + first, count - first);
+    return true;
+  }
+
+/**
+* @brief Visit the records of a domain, or of every domain for rank 0, between two times included
+* Returns the number of records visited.
+*/
+  size_t scan(uint64_t rank, uint64_t time_from, uint64_t time_to, const Visitor& visit) const {
+
+    size_t visited = 0;
+
+    std::vector<SeriesRecord> records;
+
+    for (auto& sequence : getSequences()) {
+      if (sequence.second) {
+        visited += scanCompacted(getPath(sequence.first, "dpc"), rank, time_from, time_to, visit, records);
+        continue;
+      }
+
+      Segment segment;
+      if (!segment.open(getPath(sequence.first), 0, false)) continue;
+
+      const SegmentHeader* header = segment.header;
+      uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+      if (!count || header->time_max < time_from || header->time_min > time_to) {
+        segment.close();
+        continue;
+      }
+
+      for (uint64_t first = 0; first < count; first += BLOCK_RECORDS) {
+        const BlockIndex& block = segment.index[first / BLOCK_RECORDS];
+        if (block.time_max < time_from || block.time_min > time_to) continue;
+        if (rank && (block.rank_max < rank || block.rank_min > rank)) continue;
+
+        for (uint64_t i = first, last = std::min(count, first + BLOCK_RECORDS); i < last; i++) {
+          const SeriesRecord& record = segment.records[i];
+          if (record.time < time_from || record.time > time_to || (rank && record.rank != rank)) continue;
+          visit(record);
+          visited++;
+        }
+      }
+
+      segment.close();
+    }
+
+    return visited;
+  }
+
+  ~SeriesStore() { close(); }
+
+private:
+
+/// Decode a compacted segment overlapping the range and visit its matching records
+  static size_t scanCompacted(const std::string& path, uint64_t rank, uint64_t time_from, uint64_t time_to, 
+                              const Visitor& visit, std::vector<SeriesRecord>& records) {
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(ColumnarSegment::Header)) {
+      if (fd >= 0) ::close(fd);
+      return 0;
+    }
+
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const ColumnarSegment::Header* header = (const ColumnarSegment::Header*)map;
+    bool overlaps = header->time_max >= time_from && header->time_min <= time_to && 
+                    (!rank || (header->rank_min <= rank && header->rank_max >= rank));
+
+    size_t visited = 0;
+    if (overlaps && !ColumnarSegment::decode((const uint8_t*)map, st.st_size, records)) {
+      Log::write("Corrupt segment " + path, Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    } else if (overlaps) {
+      for (const SeriesRecord& record : records) {
+        if (record.time < time_from || record.time > time_to || (rank && record.rank != rank)) continue;
+        visit(record);
+        visited++;
+      }
+    }
+
+    munmap(map, st.st_size);
+    return visited;
+  }
+};
+
+/**
+* @brief Domain statistics in a database, measurements in a series store
+*/
+class SeriesAccess: public DBAccess {
+
+  std::shared_ptr<DBAccess> _dbaccess;
+  std::string _directory;
+  SeriesStore _store;
+
+public:
+
+  SeriesAccess(const std::shared_ptr<DBAccess>& dbaccess, const std::string& directory, size_t segment_records = DEFAULT_SEGMENT_SIZE, bool keep_labels = true): 
+    _dbaccess(dbaccess), _directory(directory), _store(segment_records, keep_labels) {}
+
+/// Connect to the database and open the store
+  bool connect(const char* dbname = 0, const char* username = 0, const char* password = 0) { 
+
+    if (!_store.open(_directory)) {
+      std::string message = "Cannot open the measurement store " + _directory + ". Exiting..";
+      Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      throw std::runtime_error(message);
+    }
+
+    return _dbaccess->connect(dbname, username, password);
+  }
+
+  bool disconnect() {
+    _store.close();
+    return _dbaccess->disconnect();
+  }
+
+  bool loadDomains(Domains& domains)   { return _dbaccess->loadDomains(domains); }
+  bool addDomains(Domains& domains)    { return _dbaccess->addDomains(domains); }
+  bool deleteDomains(Domains& domains) { return _dbaccess->deleteDomains(domains); }
+
+  bool loadSketch(size_t rank, Time from, Time to, DDSketch& sketch, const std::string& vantage = "") { 
+    return _dbaccess->loadSketch(rank, from, to, sketch, vantage); 
+  }
+
+/**
+* @brief Append measurements to the store, those it cannot take go to the database with the statistics
+* The database rolls up what the store took, it never sees those events.
+*/
+  bool saveDomains(Domains& domains) {
+    bool rolled = true;
+    _store.append(domains, [this, &rolled](const SeriesRecord* records, size_t count) { rolled &= _dbaccess->rollUp(records, count); });
+    return _dbaccess->saveDomains(domains) && rolled;
+  }
+
+/// Give access to the store for scans
+  SeriesStore& getStore() { return _store; }
+};
+
+/**
+* @brief Statistics of the database writer
+*/
+struct DBWriterStats {
+  size_t flushes;
+  size_t domains;
+  size_t events;
+  size_t rejected;
+  size_t failures;
+  size_t lost;
+  size_t queue_depth;
+  size_t queue_depth_max;
+  double flush_time_last;
+  double flush_time_max;
+  double flush_time_sum;
+};
+
+/**
+* @brief Background database writer
+* Snapshots of domain statistics along with their pending events are handed
+* over through a bounded queue and written by a dedicated thread, so probing
+* never waits for the database. A full queue turns snapshots down and the
+* events stay with their domains until the next hand-over, up to 
+* DEFAULT_PENDING_EVENTS each. Snapshots that fail to be written stay queued 
+* and are written again.
+*/
+class DBWriter {
+
+  std::shared_ptr<DBAccess> _dbaccess;
+  size_t _capacity;
+  std::deque<std::shared_ptr<Domains> > _queue;
+
+  /// Snapshots being taken, they hold a place in the queue
+  size_t _reserved;
+
+  bool _flag_stop;
+
+  /// Stopping: failed snapshots get a few more attempts without delay
+  bool _flag_stopping;
+
+  std::mutex _mutex;
+  std::condition_variable _ready;
+  std::condition_variable _room;
+  std::thread _thread;
+  DBWriterStats _stats;
+
+/**
+* @brief Writer thread: write snapshots in order until stopped and drained
+* A snapshot stays at the front of the queue until it is written. After a 
+* failure, what the backend wrote leaves it and the rest is written again 
+* after a growing delay, meanwhile the queue fills up and the events stay 
+* with their domains. Once stopping, a few more attempts are made before 
+* the snapshot is given up.
+*/
+  void run() {
+
+    Time delay = DEFAULT_DB_RETRY_DELAY;
+    size_t attempts = 0;
+
+    for (;;) {
+      std::shared_ptr<Domains> snapshot;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [this] { return !_queue.empty() || (_flag_stop && !_reserved); });
+        if (_queue.empty()) return;
+        snapshot = _queue.front();
+      }
+
+      size_t domains = snapshot->size(), events = countEvents(*snapshot);
+
+      double start = monotonicTime();
+      bool saved = _dbaccess->saveDomains(*snapshot);
+      double elapsed = monotonicTime() - start;
+
+      // Domains left with changes were not written
+      if (saved) 
+        snapshot->clear();
+      else 
+        snapshot->erase(std::remove_if(snapshot->begin(), snapshot->end(), [](const Domain& domain) { return !domain.hasChanges(); }), snapshot->end());
+      size_t left = countEvents(*snapshot);
+
+      size_t depth;
+      bool stopping, retry = false;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.flushes++;
+        _stats.domains += domains - snapshot->size();
+        _stats.events  += events - left;
+        _stats.flush_time_last = elapsed;
+        _stats.flush_time_max  = std::max(_stats.flush_time_max, elapsed);
+        _stats.flush_time_sum += elapsed;
+        if (!saved) _stats.failures++;
+
+        stopping = _flag_stopping;
+        if (!snapshot->empty() && (!stopping || ++attempts <= DEFAULT_DB_RETRY_STOP)) {
+          retry = true;
+        } else {
+          _stats.lost += left;
+          _queue.pop_front();
+          attempts = 0;
+        }
+        depth = _queue.size();
+      }
+      if (!retry) _room.notify_all();
+
+      if (!snapshot->empty()) {
+        std::stringstream msg;
+        msg << "Failed to save " << snapshot->size() << " domains and " << left << " events, " 
+            << (!retry ? std::string("giving them up") : stopping ? std::string("retrying before stopping") : "retrying in " + std::to_string(delay) + " ms");
+        Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+
+        // Stopping cuts the delay short
+        if (retry && !stopping) {
+          std::unique_lock<std::mutex> lock(_mutex);
+          _ready.wait_for(lock, std::chrono::milliseconds(delay), [this] { return _flag_stopping; });
+          delay = std::min(2 * delay, DEFAULT_DB_RETRY_DELAY_MAX);
+        }
+        continue;
+      }
+      delay = DEFAULT_DB_RETRY_DELAY;
+
+      if (Log::isEnabled(Log::LOG_INFO)) {
+        std::stringstream msg;
+        msg << "Saved " << domains << " domains and " << events << " events in " << elapsed << " ms, " << depth << " snapshots queued";
+        Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+      }
+    }
+  }
+
+/// Events pending in a snapshot
+  static size_t countEvents(Domains& domains) {
+    size_t events = 0;
+    for (auto& domain : domains) events += domain.getEvents().size();
+    return events;
+  }
+
+/// Hold a place in the queue for a snapshot, false when the queue is full. Once stopping, may wait for a place to free up.
+  bool reserve(bool wait) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (wait) _room.wait(lock, [this] { return _queue.size() + _reserved < _capacity || !_flag_stopping || _flag_stop; });
+    if (_queue.size() + _reserved >= _capacity) {
+      _stats.rejected++;
+      return false;
+    }
+    _reserved++;
+    return true;
+  }
+
+/// Count the pending events of domains turned down for good
+  void lose(size_t events) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats.lost += events;
+  }
+
+/// Move the pending events and a copy of the statistics of a domain to the snapshot, the writer owns them from now on
+  static void take(Domain& domain, Domains& snapshot) {
+    snapshot.push_back(domain.snapshot());
+    domain.setClean();
+  }
+
+/// Queue a snapshot in the place held for it, the events its domains dropped are lost
+  void queue(const std::shared_ptr<Domains>& snapshot) {
+    size_t dropped = 0;
+    for (const auto& domain : *snapshot) dropped += domain.getDropped();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _reserved--;
+      _stats.lost += dropped;
+      _queue.push_back(snapshot);
+      _stats.queue_depth_max = std::max(_stats.queue_depth_max, _queue.size());
+    }
+    _ready.notify_one();
+  }
+
+public:
+
+  DBWriter(const std::shared_ptr<DBAccess>& dbaccess, size_t capacity = DEFAULT_DB_QUEUE_SIZE): 
+    _dbaccess(dbaccess), _capacity(std::max(size_t(1), capacity)), _reserved(0), _flag_stop(false), _flag_stopping(false), _stats() {}
+
+/// Launch the writer thread
+  void start() {
+    _flag_stop = _flag_stopping = false;
+    _thread = std::thread(&DBWriter::run, this);
+  }
+
+/**
+* @brief Take a snapshot of the changed domains and queue it without waiting
+* The pending events move to the snapshot and the domains turn clean. Returns 
+* false when the queue is full, the domains are then left untouched. A last 
+* hand-over waits for room once the writer is stopping, what it cannot queue 
+* is counted as lost.
+*/
+  bool push(Domains& domains, bool last = false) {
+
+    size_t changes = std::count_if(domains.begin(), domains.end(), [](const Domain& domain) { return domain.hasChanges(); });
+    if (!changes) return true;
+    if (!reserve(last)) {
+      if (last) for (auto& domain : domains) lose(domain.getEvents().size() + domain.getDropped());
+      return false;
+    }
+
+    std::shared_ptr<Domains> snapshot(new Domains);
+    snapshot->reserve(changes);
+    for (auto& domain : domains) 
+      if (domain.hasChanges()) take(domain, *snapshot);
+
+    queue(snapshot);
+    return true;
+  }
+
+/// Same for domains bound to a table by their index, only the change flags of the table are scanned
+  bool push(Domains& domains, DomainTable& table, bool last = false) {
+
+    size_t changes = table.countChanges();
+    if (!changes) return true;
+    if (!reserve(last)) {
+      if (last) table.visitChanges([this, &domains](size_t id) { lose(domains[id].getEvents().size() + domains[id].getDropped()); });
+      return false;
+    }
+
+    std::shared_ptr<Domains> snapshot(new Domains);
+    snapshot->reserve(changes);
+    table.visitChanges([&domains, &snapshot](size_t id) { take(domains[id], *snapshot); });
+
+    queue(snapshot);
+    return true;
+  }
+
+/// Cut the retries short without waiting: failed snapshots get DEFAULT_DB_RETRY_STOP more attempts and last hand-overs wait for room
+  void beginStop() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _flag_stopping = true;
+    }
+    _ready.notify_one();
+    _room.notify_all();
+  }
+
+/// Write the queued snapshots and stop the writer thread
+  void stop() {
+    beginStop();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _flag_stop = true;
+    }
+    _ready.notify_one();
+    _room.notify_all();
+    if (_thread.joinable()) _thread.join();
+  }
+
+/// Counters since the writer was created
+  DBWriterStats getStats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    DBWriterStats stats = _stats;
+    stats.queue_depth = _queue.size();
+    return stats;
+  }
+
+  ~DBWriter() { stop(); }
+};
+
+//============================== Network communication ==================================//
+/**
+* @brief Remote host reply
+*/
+struct Reply {
+  Time time;
+  std::string target;
+  EventType event;
+  double duration;
+};
+
+
+/**
+* @brief Remote Query abstract class
+*/
+class RemoteQuery {
+
+protected:
+
+  /// Domain of the shard, which owns it and outlives the query
+  Domain* _p_domain;
+
+public:
+
+  RemoteQuery(Domain& domain): _p_domain(&domain) {}
+
+/**
+* @brief Send a query
+*/
+  virtual std::pair<Reply,bool> sendQuery()= 0;
+
+/**
+* @brief Probe a target
+*/
+  bool probe(){
+
+    // Send query
+    std::pair<Reply,bool> reply = sendQuery();
+    
+    // Process reply      
+    if (!reply.second) {
+      Log::write("Cannot send query to " + _p_domain->getName(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    }
+    
+     // Update the domain
+    _p_domain->update({reply.first.time, reply.first.target, reply.first.event, reply.first.duration}); 
+
+    return  reply.second;
+  }
+
+  ~RemoteQuery(){}
+};
+
+typedef std::unordered_map<std::string, std::shared_ptr<RemoteQuery> > RemoteQueries;
+
+
+/**
+* @brief DNS Query implementation class
+*/
+class DNSQuery : public RemoteQuery {
+
+  ldns_resolver* _ns_resolver;
+  ldns_rdf* _ns_name;
+  ldns_rr_list* _ns_addresses;
+
+public:
+
+  DNSQuery(Domain& domain) : RemoteQuery(domain) { 
+    // Initialize ldns variables
+    _ns_name = ldns_dname_new_frm_str(_p_domain->getName().c_str());
+
+    if (ldns_resolver_new_frm_file(&_ns_resolver, NULL) != LDNS_STATUS_OK) {
+        const char * message = "Cannot create a resolver. Exiting..";
+        Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+        throw std::runtime_error(message);
+    }
+    
+    // Set the number of retries
+    ldns_resolver_set_retry(_ns_resolver, DEFAULT_DNS_RETRY);
+  }
+
+/**
+* @brief Send a DNS query
+*/
+  std::pair<Reply,bool> sendQuery() {
+
+    Reply reply;
+    // By default the event is the request. It is updated by the reply if any.
+    reply.target   = _p_domain->getRandomTarget() + "." + _p_domain->getName();
+    reply.time     = time(0);
+    reply.event    = EV_SEND_REQUEST;
+
+    if (Log::isEnabled(Log::LOG_INFO))
+      Log::write("Sending query for " + reply.target, Log::LOG_INFO, __FUNCTION__, __LINE__); 
+
+    ldns_pkt* packet = NULL;
+    struct timespec start_time, end_time;
+    
+    // Measure query duration
+    clock_gettime(CLOCK_REALTIME, &start_time);
+    ldns_status query_status = ldns_resolver_query_status(&packet, _ns_resolver, _ns_name, LDNS_RR_TYPE_A, LDNS_RR_CLASS_CH, LDNS_RD);
+    clock_gettime(CLOCK_REALTIME, &end_time);
+
+    const double  SEC_TO_MILLI  = 1e+3;
+    const double  MILLI_TO_NANO = 1e+3;
+    
+    // Set the duration in ms
+    reply.duration = (end_time.tv_sec - start_time.tv_sec) * SEC_TO_MILLI  + (end_time.tv_nsec - start_time.tv_nsec) / MILLI_TO_NANO;
+
+    if (packet && ldns_pkt_qr(packet)) {
+        // If a packet was received
+        reply.event = EV_RECV_DATA;
+
+        std::string reply_ns_str;          
+        bool logged = Log::isEnabled(Log::LOG_INFO);
+        if (query_status == LDNS_STATUS_OK) {
+          // Update timestamp
+          struct timeval timev = ldns_pkt_timestamp(packet);
+          reply.time = timev.tv_sec; 
+        
+          //Update duration
+          reply.duration  = ldns_pkt_querytime(packet);
+
+          // Get name server name
+          if (logged) {
+            ldns_rdf* reply_ns =  ldns_pkt_answerfrom(packet);
+            char* str = ldns_rdf2str(reply_ns);
+            reply_ns_str = " from " + std::string(str);
+            LDNS_FREE(str);
+          }
+        }
+        if (logged) {
+          std::stringstream msg;
+          msg << "Got answer" << reply_ns_str << " with status: { " << ldns_get_errorstr_by_id(query_status) << " } in " << reply.duration << " ms"; 
+          Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+        }
+
+        ldns_pkt_free(packet);
+    }
+
+    return std::make_pair(reply, true);
+  };
+
+  ~DNSQuery() {
+    // Free LDNS resources
+    if (Log::isEnabled(Log::LOG_DEBUG))
+      Log::write("Free LDNS resources for domain " + _p_domain->getName(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    for (;ldns_rdf *ns = ldns_resolver_pop_nameserver(_ns_resolver); ldns_rdf_deep_free(ns));
+    ldns_rdf_deep_free(_ns_name); 
+    ldns_resolver_deep_free(_ns_resolver); 
+  }
+};
+
+  
+//============================== Probe engines ==================================//
+/**
+* @brief Probe engine types
+*/
+typedef enum {
+  ENGINE_EPOLL,
+  ENGINE_MMSG,
+  ENGINE_URING,
+  ENGINE_LDNS,
+} EngineType;
+
+/**
+* @brief Probe engine settings
+*/
+struct EngineConfig {
+  EngineType type;
+  Time timeout;
+  struct sockaddr_storage resolver;
+  socklen_t resolver_len;
+
+/// Default settings: the resolver is taken from /etc/resolv.conf
+  EngineConfig(EngineType type = ENGINE_EPOLL, Time timeout = DEFAULT_DNS_TIMEOUT): type(type), timeout(timeout), resolver_len(0) {
+    memset(&resolver, 0, sizeof(resolver));
+  }
+
+/**
+* @brief Set the resolver from "address", "ipv4:port" or "[ipv6]:port"
+*/
+  bool setResolver(const std::string& address) {
+
+    std::string host = address;
+    int port = LDNS_PORT;
+
+    size_t colon = address.rfind(':');
+    if (address[0] == '[') {
+      size_t bracket = address.find(']');
+      if (bracket == std::string::npos) return false;
+      host = address.substr(1, bracket - 1);
+      if (bracket + 1 < address.length()) {
+        if (address[bracket + 1] != ':') return false;
+        port = atoi(address.c_str() + bracket + 2);
+      }
+    } else if (colon != std::string::npos && address.find(':') == colon) {
+      host = address.substr(0, colon);
+      port = atoi(address.c_str() + colon + 1);
+    }
+
+    if (port <= 0 || port > 65535) return false;
+
+    memset(&resolver, 0, sizeof(resolver));
+    struct sockaddr_in*  in4 = (struct sockaddr_in*)&resolver;
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&resolver;
+
+    if (inet_pton(AF_INET, host.c_str(), &in4->sin_addr) == 1) {
+      in4->sin_family = AF_INET;
+      in4->sin_port   = htons(port);
+      resolver_len    = sizeof(*in4);
+    } else if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1) {
+      in6->sin6_family = AF_INET6;
+      in6->sin6_port   = htons(port);
+      resolver_len     = sizeof(*in6);
+    } else {
+      resolver_len = 0;
+      return false;
+    }
+
+    return true;
+  }
+};
+
+/**
+* @brief Probe engine counters
+*/
+struct EngineStats {
+  size_t queries;
+  size_t replies;
+  size_t timeouts;
+  size_t errors;
+  size_t syscalls;
+};
+
+/**
+* @brief Probe engine abstract class
+* An engine sends queries on behalf of domains and
+* turns replies and timeouts into domain events
+*/
+class ProbeEngine {
+
+protected:
+
+  EngineStats _stats;
+
+  /// Descriptor waking poll() up, -1 when none
+  int _watch_fd;
+
+/// Consume the readiness of the watched descriptor
+  void clearWatch() {
+    uint64_t expirations;
+    _stats.syscalls++;
+    if (read(_watch_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) 
+      Log::write(std::string("Cannot read the watched descriptor: ") + strerror(errno), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+  }
+
+public:
+
+  ProbeEngine(): _stats(), _watch_fd(-1) {}
+
+/// Prepare the engine for probing the given domains
+  virtual bool open(Domains& domains) = 0;
+
+/// Send a query for a domain
+  virtual bool send(Domain& domain) = 0;
+
+/// Process replies and timeouts for at most timeout ms or until the watched descriptor 
+/// becomes readable, returns the number of completed queries
+  virtual size_t poll(Time timeout) = 0;
+
+/// Watch a non-blocking descriptor such as a timerfd along with the replies
+  virtual void watch(int fd) { _watch_fd = fd; }
+
+/// Number of queries waiting for a reply or a timeout
+  virtual size_t pending() const = 0;
+
+/// Push the queries an engine may have held back for batching
+  virtual void flush() {}
+
+/// Counters since the engine was created
+  const EngineStats& getStats() const { return _stats; }
+
+/**
+* @brief Probe every domain once and wait until each query completes
+*/
+  void probe(Domains& domains) {
+    for (auto& domain : domains) 
+      send(domain);
+    flush();
+
+    while (pending()) 
+      poll(DEFAULT_DNS_TIMEOUT);
+  }
+
+  virtual ~ProbeEngine() {}
+};
+
+/**
+* @brief Serial engine sending one blocking ldns query at a time
+*/
+class LdnsEngine : public ProbeEngine {
+
+  RemoteQueries _remoteQueries;
+
+public:
+
+  bool open(Domains& domains) {
+    for (auto& domain : domains) 
+      _remoteQueries.insert(std::make_pair(domain.getName(), std::shared_ptr<RemoteQuery>(new DNSQuery(domain))));
+    return true;
+  }
+
+  bool send(Domain& domain) {
+    auto it = _remoteQueries.find(domain.getName());
+    if (it == _remoteQueries.end()) return false;
+
+    _stats.queries++;
+    return it->second->probe();
+  }
+
+/// Queries complete within send(), there is nothing to wait for but time
+  size_t poll(Time timeout) { 
+    struct pollfd pfd = {_watch_fd, POLLIN, 0};
+    _stats.syscalls++;
+    if (::poll(&pfd, 1, timeout) > 0) clearWatch();
+    return 0; 
+  }
+
+  size_t pending() const { return 0; }
+};
+
+/**
+* @brief Base class of the engines sending datagrams to the resolver
+* Queries are sent on non-blocking UDP sockets connected to the resolver. 
+* Every in-flight query owns a slot whose index is encoded in the DNS ID 
+* so replies are matched to their domain in O(1). Queries that are not 
+* answered within the timeout produce EV_TIMEOUT events.
+*/
+class DatagramEngine : public ProbeEngine {
+
+protected:
+
+  /// Slots per socket: the low bits of the DNS ID give the slot, the high bits a generation
+  static const unsigned SLOT_BITS    = 10;
+  static const unsigned SLOT_COUNT   = 1 << SLOT_BITS;
+
+  /// Replies to queries without EDNS fit in a minimal DNS message
+  static const unsigned MAX_UDP_SIZE = 512;
+
+/**
+* @brief In-flight query
+*/
+  struct Slot {
+    Domain* domain;
+    uint16_t id;
+    bool busy;
+    uint8_t label_len;
+    char label[QueryTemplate::MAX_LABEL];
+    Time time;
+    double start;
+
+    std::string getTarget() const { return std::string(label, label_len) + "." + domain->getName(); }
+  };
+
+/**
+* @brief Expiry of an in-flight query
+*/
+  struct Deadline {
+    double expiry;
+    uint32_t slot;
+    uint16_t id;
+  };
+
+  std::vector<int> _sockets;
+  std::vector<Slot> _slots;
+  std::vector<uint32_t> _free_slots;
+  std::vector<Deadline> _deadlines;
+  size_t _deadline_head;
+  size_t _deadline_count;
+  size_t _pending;
+  Time _timeout;
+  struct sockaddr_storage _resolver;
+  socklen_t _resolver_len;
+
+/// Open one more socket and make its slots available
+  virtual void addSocket() = 0;
+
+/// Open a socket connected to the resolver with its slots, returns its index
+  uint32_t openSocket() {
+
+    int fd = socket(_resolver.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&_resolver, _resolver_len) < 0) {
+      if (fd >= 0) close(fd);
+      std::string message = std::string("Cannot open a socket to the resolver: ") + strerror(errno);
+      Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      throw std::runtime_error(message);
+    }
+
+    // Leave room for reply bursts
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &DEFAULT_SOCKET_BUFFER, sizeof(DEFAULT_SOCKET_BUFFER));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &DEFAULT_SOCKET_BUFFER, sizeof(DEFAULT_SOCKET_BUFFER));
+
+    uint32_t first = _slots.size();
+    _sockets.push_back(fd);
+    _slots.resize(first + SLOT_COUNT, Slot());
+    for (uint32_t slot = first + SLOT_COUNT; slot > first; _free_slots.push_back(--slot));
+
+    std::stringstream msg;
+    msg << "Opened socket #" << _sockets.size() << " for " << _slots.size() << " in-flight queries";
+    Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+
+    return _sockets.size() - 1;
+  }
+
+/// Queue a deadline, the ring only grows when more queries are in flight than ever before
+  void pushDeadline(const Deadline& deadline) {
+    if (_deadline_count == _deadlines.size()) {
+      std::rotate(_deadlines.begin(), _deadlines.begin() + _deadline_head, _deadlines.end());
+      _deadlines.resize(std::max<size_t>(2 * _deadlines.size(), SLOT_COUNT));
+      _deadline_head = 0;
+    }
+    _deadlines[(_deadline_head + _deadline_count++) % _deadlines.size()] = deadline;
+  }
+
+/// Time to wait for replies, at most timeout and never past the next deadline
+  double getWaitTime(Time timeout) const {
+    double wait = timeout;
+    if (_deadline_count) wait = std::min(wait, _deadlines[_deadline_head].expiry - monotonicTime());
+    return std::max(wait, 0.);
+  }
+
+/**
+* @brief Take a slot for a query to the domain and patch the query packet
+* The query is patched in the pre-encoded packet of the domain without any allocation
+*/
+  bool prepare(Domain& domain, uint32_t& slot, const uint8_t*& packet, size_t& size) {
+
+    if (!domain.getQuery().isValid()) {
+      _stats.errors++;
+      domain.update({Time(time(0)), domain.getName(), EV_ERROR, 0});
+      return false;
+    }
+
+    if (_free_slots.empty()) addSocket();
+
+    slot = _free_slots.back();
+    _free_slots.pop_back();
+    _pending++;
+
+    Slot& s = _slots[slot];
+
+    // Bump the generation so that late replies to the previous query are ignored
+    s.id        = (((s.id >> SLOT_BITS) + 1) << SLOT_BITS) | (slot & (SLOT_COUNT - 1));
+    s.busy      = true;
+    s.domain    = &domain;
+    s.label_len = domain.getRandomTarget(s.label);
+    s.time      = time(0);
+
+    if (Log::isEnabled(Log::LOG_INFO))
+      Log::write("Sending query for " + s.getTarget(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+
+    packet = domain.getQuery().patch(s.id, s.label, s.label_len, size);
+    return true;
+  }
+
+/// Start the timeout of a query that left
+  void started(uint32_t slot, double start) {
+    Slot& s = _slots[slot];
+    s.start = start;
+    _stats.queries++;
+    pushDeadline({start + _timeout, slot, s.id});
+  }
+
+/// Complete an in-flight query
+  void complete(uint32_t slot, EventType type, double duration) {
+    Slot& s = _slots[slot];
+    s.busy = false;
+    _free_slots.push_back(slot);
+    _pending--;
+
+    switch (type) {
+      case EV_RECV_DATA: _stats.replies++;  break;
+      case EV_TIMEOUT:   _stats.timeouts++; break;
+      default:           _stats.errors++;   break;
+    }
+
+    s.domain->update({s.time, s.getTarget(), type, duration});
+  }
+
+/// Fail an in-flight query that could not be sent
+  void fail(uint32_t slot, int error) {
+    Log::write("Cannot send query for " + _slots[slot].getTarget() + ": " + strerror(error), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    complete(slot, EV_ERROR, 0);
+  }
+
+/// Match a datagram received on a socket to its query, returns true if a query completed
+  bool handle(uint32_t index, const uint8_t* buffer, size_t len) {
+
+    // Keep DNS responses only
+    if (len < LDNS_HEADER_SIZE || !(buffer[2] & 0x80)) return false;
+
+    uint16_t id = (buffer[0] << 8) | buffer[1];
+    uint32_t slot = index * SLOT_COUNT + (id & (SLOT_COUNT - 1));
+    Slot& s = _slots[slot];
+
+    // Discard late or spoofed replies
+    if (!s.busy || s.id != id || !s.domain->getQuery().matches(buffer, len, s.label, s.label_len)) return false;
+
+    double duration = monotonicTime() - s.start;
+
+    if (Log::isEnabled(Log::LOG_INFO)) {
+      std::stringstream msg;
+      msg << "Got answer for " << s.getTarget() << " with rcode " << (buffer[3] & 0x0f) << " in " << duration << " ms"; 
+      Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+    }
+
+    complete(slot, EV_RECV_DATA, duration);
+    return true;
+  }
+
+/// Time out queries whose deadline is over
+  size_t expire() {
+
+    size_t count = 0;
+    double now = monotonicTime();
+
+    for (; _deadline_count && _deadlines[_deadline_head].expiry <= now; _deadline_head = (_deadline_head + 1) % _deadlines.size(), _deadline_count--) {
+      const Deadline& deadline = _deadlines[_deadline_head];
+      Slot& s = _slots[deadline.slot];
+      // The generation of the ID wraps when a slot is reused often, the expiry tells queries apart
+      if (!s.busy || s.id != deadline.id || s.start + _timeout != deadline.expiry) continue;
+
+      if (Log::isEnabled(Log::LOG_INFO))
+        Log::write("Query for " + s.getTarget() + " timed out", Log::LOG_INFO, __FUNCTION__, __LINE__); 
+      complete(deadline.slot, EV_TIMEOUT, now - s.start);
+      count++;
+    }
+
+    return count;
+  }
+
+public:
+
+/**
+* @brief Constructor
+* The resolver defaults to the first name server of /etc/resolv.conf
+*/
+  DatagramEngine(const EngineConfig& config) : 
+    _deadline_head(0), _deadline_count(0), _pending(0), _timeout(config.timeout), _resolver_len(0) {
+
+    memset(&_resolver, 0, sizeof(_resolver));
+
+    if (config.resolver_len) {
+      memcpy(&_resolver, &config.resolver, config.resolver_len);
+      _resolver_len = config.resolver_len;
+    } else {
+      ldns_resolver* ns_resolver = NULL;
+      if (ldns_resolver_new_frm_file(&ns_resolver, NULL) == LDNS_STATUS_OK) {
+        if (ldns_resolver_nameserver_count(ns_resolver)) {
+          size_t len = 0;
+          struct sockaddr_storage* address = ldns_rdf2native_sockaddr_storage(ldns_resolver_nameservers(ns_resolver)[0], LDNS_PORT, &len);
+          if (address) {
+            memcpy(&_resolver, address, len);
+            _resolver_len = len;
+            LDNS_FREE(address);
+          }
+        }
+        ldns_resolver_deep_free(ns_resolver); 
+      }
+    }
+
+    if (!_resolver_len) {
+      const char * message = "Cannot find a resolver. Exiting..";
+      Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      throw std::runtime_error(message);
+    }
+  }
+
+/// Open enough sockets to have every domain in flight at once
+  bool open(Domains& domains) {
+    do addSocket(); while (_slots.size() < domains.size());
+    return true;
+  }
+
+  size_t pending() const { return _pending; }
+
+  ~DatagramEngine() {
+    for (int fd : _sockets) close(fd);
+  }
+};
+
+/**
+* @brief Event-driven engine
+* Replies are collected through epoll. In batched mode queries are held back 
+* until flush() and pushed with sendmmsg, and replies are drained with recvmmsg.
+*/
+class EpollEngine : public DatagramEngine {
+
+  static const unsigned MAX_DNS_SIZE = 4096;
+  static const int      MAX_EVENTS   = 64;
+
+  /// Batched mode: datagrams per sendmmsg / recvmmsg call
+  static const unsigned SEND_BATCH   = 1024;
+  static const unsigned RECV_BATCH   = 256;
+
+  /// Event tag of the watched descriptor
+  static const uint32_t WATCH_TAG    = ~0u;
+
+/**
+* @brief Query held back for the next batch
+*/
+  struct Staged {
+    uint32_t slot;
+    uint32_t offset;
+    uint32_t size;
+
+    bool operator<(const Staged& other) const { return slot < other.slot; }
+  };
+
+  int _epoll_fd;
+  bool _batched;
+
+  // Batched mode buffers, they only grow up to the largest batch
+  std::vector<Staged> _staged;
+  std::vector<uint8_t> _staged_data;
+  std::vector<struct mmsghdr> _msgs;
+  std::vector<struct iovec> _iovs;
+  std::vector<uint8_t> _recv_data;
+
+/// Open one more socket and watch it
+  void addSocket() {
+    uint32_t index = openSocket();
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.u32 = index;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _sockets[index], &ev);
+  }
+
+/// Drain the replies waiting on a socket
+  size_t receive(uint32_t index) {
+
+    size_t count = 0;
+
+    if (!_batched) {
+      uint8_t buffer[MAX_DNS_SIZE];
+      for (ssize_t len; _stats.syscalls++, (len = recv(_sockets[index], buffer, sizeof(buffer), 0)) >= 0; ) 
+        count += handle(index, buffer, len);
+      return count;
+    }
+
+    for (;;) {
+      for (unsigned i = 0; i < RECV_BATCH; i++) {
+        _iovs[i].iov_base = &_recv_data[i * MAX_UDP_SIZE];
+        _iovs[i].iov_len  = MAX_UDP_SIZE;
+        memset(&_msgs[i].msg_hdr, 0, sizeof(_msgs[i].msg_hdr));
+        _msgs[i].msg_hdr.msg_iov    = &_iovs[i];
+        _msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      _stats.syscalls++;
+      int n = recvmmsg(_sockets[index], _msgs.data(), RECV_BATCH, 0, NULL);
+      if (n <= 0) break;
+
+      for (int i = 0; i < n; i++) 
+        count += handle(index, &_recv_data[i * MAX_UDP_SIZE], _msgs[i].msg_len);
+
+      // A short batch means the socket is drained
+      if (unsigned(n) < RECV_BATCH) break;
+    }
+
+    return count;
+  }
+
+/// Push staged queries of one socket, returns the number of queries that left
+  size_t sendBatch(int fd, const Staged* staged, size_t count) {
+
+    for (size_t i = 0; i < count; i++) {
+      _iovs[i].iov_base = &_staged_data[staged[i].offset];
+      _iovs[i].iov_len  = staged[i].size;
+      memset(&_msgs[i].msg_hdr, 0, sizeof(_msgs[i].msg_hdr));
+      _msgs[i].msg_hdr.msg_iov    = &_iovs[i];
+      _msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    size_t done = 0;
+    while (done < count) {
+      _stats.syscalls++;
+      int n = sendmmsg(fd, &_msgs[done], count - done, 0);
+
+      if (n < 0 && errno == EAGAIN) {
+        // The socket buffer is full: give it a moment to drain
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        _stats.syscalls++;
+        if (::poll(&pfd, 1, _timeout) > 0) continue;
+      }
+      if (n <= 0) break;
+      done += n;
+    }
+
+    return done;
+  }
+
+public:
+
+  EpollEngine(const EngineConfig& config = EngineConfig(), bool batched = false) : 
+    DatagramEngine(config), _batched(batched) {
+
+    if ((_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      const char * message = "Cannot create an epoll instance. Exiting..";
+      Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      throw std::runtime_error(message);
+    }
+
+    if (_batched) {
+      _msgs.resize(std::max(SEND_BATCH, RECV_BATCH));
+      _iovs.resize(std::max(SEND_BATCH, RECV_BATCH));
+      _recv_data.resize(RECV_BATCH * MAX_UDP_SIZE);
+    }
+  }
+
+/**
+* @brief Send a DNS query for a random target of the domain
+*/
+  bool send(Domain& domain) {
+
+    uint32_t slot;
+    const uint8_t* packet;
+    size_t size = 0;
+    if (!prepare(domain, slot, packet, size)) return false;
+
+    if (_batched) {
+      // Hold the query back until the batch is full or flushed
+      _staged.push_back({slot, uint32_t(_staged_data.size()), uint32_t(size)});
+      _staged_data.insert(_staged_data.end(), packet, packet + size);
+
+      if (_staged.size() >= SEND_BATCH) flush();
+      return true;
+    }
+
+    int fd = _sockets[slot >> SLOT_BITS];
+    double start = monotonicTime();
+    _stats.syscalls++;
+    ssize_t sent = ::send(fd, packet, size, 0);
+
+    // The socket buffer is full: give it a moment to drain
+    if (sent < 0 && errno == EAGAIN) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      _stats.syscalls += 2;
+      if (::poll(&pfd, 1, _timeout) > 0) sent = ::send(fd, packet, size, 0);
+    }
+
+    if (sent < 0) {
+      fail(slot, errno);
+      return false;
+    }
+
+    started(slot, start);
+    return true;
+  }
+
+/**
+* @brief Push held back queries, one sendmmsg per socket and batch
+*/
+  void flush() {
+
+    if (_staged.empty()) return;
+
+    // Group queries by socket
+    std::sort(_staged.begin(), _staged.end());
+
+    for (size_t first = 0, last; first < _staged.size(); first = last) {
+      uint32_t index = _staged[first].slot >> SLOT_BITS;
+      for (last = first + 1; last < _staged.size() && last - first < SEND_BATCH && (_staged[last].slot >> SLOT_BITS) == index; last++);
+
+      double start = monotonicTime();
+      size_t done = sendBatch(_sockets[index], &_staged[first], last - first);
+
+      for (size_t i = first; i < last; i++) {
+        if (i < first + done) 
+          started(_staged[i].slot, start);
+        else 
+          fail(_staged[i].slot, errno);
+      }
+    }
+
+    _staged.clear();
+    _staged_data.clear();
+  }
+
+  void watch(int fd) {
+    ProbeEngine::watch(fd);
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.u32 = WATCH_TAG;
+    epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+/**
+* @brief Wait for replies until something completes, timeout ms elapse or the watched descriptor is ready
+*/
+  size_t poll(Time timeout) {
+
+    flush();
+
+    size_t count = expire();
+
+    if (!count) {
+      struct epoll_event events[MAX_EVENTS];
+      _stats.syscalls++;
+      int n = epoll_wait(_epoll_fd, events, MAX_EVENTS, int(std::ceil(getWaitTime(timeout))));
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.u32 == WATCH_TAG) 
+          clearWatch();
+        else
+          count += receive(events[i].data.u32);
+      }
+
+      count += expire();
+    }
+
+    return count;
+  }
+
+  ~EpollEngine() {
+    close(_epoll_fd);
+  }
+};
+
+/**
+* @brief io_uring engine
+* Queries are written from a registered buffer holding one packet per slot and
+* every socket keeps a multishot receive armed on a ring of provided buffers.
+* A whole batch of queries is submitted and replies are reaped with a single
+* io_uring_enter, so the syscall count hardly depends on the probe rate.
+*/
+class UringEngine : public DatagramEngine {
+
+  static const unsigned SQ_ENTRIES   = 4096;
+  static const unsigned CQ_ENTRIES   = 65536;
+  static const unsigned RECV_BUFFERS = 4096;
+  static const uint16_t RECV_GROUP   = 0;
+
+  /// Room for the largest pre-encoded query
+  static const unsigned QUERY_SIZE   = 320;
+
+  /// Operation tags in the user data of submissions
+  static const uint64_t OP_RECV      = 1;
+  static const uint64_t OP_WRITE     = 2;
+  static const uint64_t OP_WATCH     = 3;
+
+  int _ring_fd;
+  struct io_uring_params _params;
+
+  // Submission queue
+  void* _sq_ring;
+  size_t _sq_ring_size;
+  unsigned* _sq_head;
+  unsigned* _sq_tail;
+  unsigned* _sq_array;
+  unsigned _sq_mask;
+  unsigned _sq_local_tail;
+  struct io_uring_sqe* _sqes;
+  size_t _sqes_size;
+  unsigned _to_submit;
+
+  // Completion queue
+  void* _cq_ring;
+  size_t _cq_ring_size;
+  unsigned* _cq_head;
+  unsigned* _cq_tail;
+  unsigned _cq_mask;
+  struct io_uring_cqe* _cqes;
+
+  // Provided receive buffers, entries are indexed from the ring base because
+  // the flexible array of io_uring_buf_ring is shifted by an empty struct in C++
+  struct io_uring_buf_ring* _buf_ring;
+  struct io_uring_buf* _bufs;
+  size_t _buf_ring_size;
+  uint16_t _buf_tail;
+  std::vector<uint8_t> _recv_data;
+
+  // Registered send buffer with one packet per slot, replaced ones are kept for writes in flight
+  std::vector<uint8_t> _send_data;
+  std::vector<std::vector<uint8_t> > _retired_data;
+  bool _fixed;
+
+  // Queries submitted with the next flush
+  std::vector<uint32_t> _staged;
+
+/// Fatal ring error
+  static void error(const std::string& message) {
+    std::string text = message + ": " + strerror(errno);
+    Log::write(text, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+    throw std::runtime_error(text);
+  }
+
+  int enter(unsigned to_submit, unsigned min_complete, unsigned flags, double timeout = -1) {
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+
+    if (timeout >= 0) {
+      ts.tv_sec  = Time(timeout) / 1000;
+      ts.tv_nsec = (timeout - ts.tv_sec * 1e+3) * 1e+6;
+      arg.ts     = (uint64_t)&ts;
+      flags     |= IORING_ENTER_EXT_ARG;
+    }
+
+    _stats.syscalls++;
+    return syscall(__NR_io_uring_enter, _ring_fd, to_submit, min_complete, flags, timeout >= 0 ? &arg : NULL, sizeof(arg));
+  }
+
+/// Hand the queued submissions to the kernel
+  void submit() {
+    if (!_to_submit) return;
+    __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+    enter(_to_submit, 0, 0);
+    _to_submit = 0;
+  }
+
+/// Get a cleared submission entry, submitting first when the queue is full
+  struct io_uring_sqe* getSqe() {
+    if (_sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _params.sq_entries) submit();
+
+    unsigned index = _sq_local_tail++ & _sq_mask;
+    _sq_array[index] = index;
+    _to_submit++;
+
+    struct io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+/// Arm a multishot receive on a socket
+  void armReceive(uint32_t index) {
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = _sockets[index];
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = (OP_RECV << 48) | index;
+  }
+
+/// Arm a multishot poll on the watched descriptor
+  void armWatch() {
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = _watch_fd;
+    sqe->len           = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = OP_WATCH << 48;
+  }
+
+/// Give a receive buffer back to the kernel
+  void recycle(uint16_t bid) {
+    struct io_uring_buf* buf = &_bufs[_buf_tail & (RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)&_recv_data[bid * MAX_UDP_SIZE];
+    buf->len  = MAX_UDP_SIZE;
+    buf->bid  = bid;
+    __atomic_store_n(&_buf_ring->tail, ++_buf_tail, __ATOMIC_RELEASE);
+  }
+
+/// (Re)register the send buffer with one packet per slot
+  void registerSendBuffer() {
+
+    if (_fixed) {
+      submit();
+      syscall(__NR_io_uring_register, _ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    }
+
+    if (!_send_data.empty()) _retired_data.push_back(std::move(_send_data));
+    _send_data.assign(_slots.size() * QUERY_SIZE, 0);
+
+    struct iovec iov = {_send_data.data(), _send_data.size()};
+    _fixed = syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    if (!_fixed) 
+      Log::write(std::string("Cannot register the send buffer, falling back to plain writes: ") + strerror(errno), Log::LOG_WARN, __FUNCTION__, __LINE__); 
+  }
+
+/// Open one more socket and start receiving, the send buffer grows once the engine is open
+  void addSocket() {
+    uint32_t index = openSocket();
+
+    // io_uring returns EAGAIN on non-blocking sockets instead of waiting for data
+    fcntl(_sockets[index], F_SETFL, fcntl(_sockets[index], F_GETFL) & ~O_NONBLOCK);
+
+    armReceive(index);
+    if (!_send_data.empty()) registerSendBuffer();
+  }
+
+/// Process the available completions
+  size_t reap() {
+
+    size_t count = 0;
+    unsigned head = *_cq_head;
+
+    for (; head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE); head++) {
+      const struct io_uring_cqe* cqe = &_cqes[head & _cq_mask];
+      uint64_t op = cqe->user_data >> 48;
+      uint32_t index = cqe->user_data & 0xffffffff;
+
+      if (op == OP_WATCH) {
+        if (cqe->res > 0) clearWatch();
+        if (!(cqe->flags & IORING_CQE_F_MORE)) armWatch();
+        continue;
+      }
+
+      if (op == OP_WRITE) {
+        // Successful writes do not post completions
+        uint16_t id = (cqe->user_data >> 32) & 0xffff;
+        if (_slots[index].busy && _slots[index].id == id) {
+          fail(index, -cqe->res);
+          count++;
+        }
+        continue;
+      }
+
+      if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        count += handle(index, &_recv_data[bid * MAX_UDP_SIZE], cqe->res);
+        recycle(bid);
+      } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        Log::write(std::string("Receive failed: ") + strerror(-cqe->res), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+      }
+
+      // The kernel stops a multishot receive when it runs out of buffers
+      if (!(cqe->flags & IORING_CQE_F_MORE)) armReceive(index);
     }
 
-  };
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
 
-/// Add domains
-  bool addDomains(Domains& domains)  {
+public:
 
-    if (!domains.size()) return false; 
+  UringEngine(const EngineConfig& config = EngineConfig()) : 
+    DatagramEngine(config), _to_submit(0), _buf_tail(0), _fixed(false) {
 
-    std::stringstream sql;
-    sql <<  "INSERT INTO domain (name, query_time_avg, query_time_stddev, query_count, time_first, time_last) VALUES \n";
-    
-    int i = 0;    
-    for (const auto& domain : domains){
-      if (i > 0) sql << ","; 
-      sql << "('" << domain.getName() << "'," << domain.getQueryTimeAvg() << "," << domain.getQueryTimeStdDev() << ","
-          << domain.getQueryCount() << ", FROM_UNIXTIME("  << domain.getTimeFirst() << "), FROM_UNIXTIME(" << domain.getTimeLast() << "))\n";
-      i++;
+    memset(&_params, 0, sizeof(_params));
+    _params.flags      = IORING_SETUP_CQSIZE;
+    _params.cq_entries = CQ_ENTRIES;
+
+    if ((_ring_fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &_params)) < 0) 
+      error("Cannot create an io_uring instance");
+
+    if (!(_params.features & IORING_FEAT_EXT_ARG)) {
+      errno = ENOSYS;
+      error("io_uring lacks timed waits");
     }
-    sql << ";";
 
-    Log::write("Inserting domains with query { " + sql.str() + " }", Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    // Map the rings
+    _sq_ring_size = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+    _cq_ring_size = _params.cq_off.cqes + _params.cq_entries * sizeof(struct io_uring_cqe);
+    if (_params.features & IORING_FEAT_SINGLE_MMAP) 
+      _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
 
-    // Execute the SQL statement
-    mysqlpp::Query query = _connection.query(sql.str());
-    if (! query.execute()) { 
-      std::stringstream msg;
-      msg <<  "Failed to execute SQL statement: " << query.error();
-      Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    _sq_ring = mmap(0, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+    if (_sq_ring == MAP_FAILED) error("Cannot map the submission queue");
+
+    _cq_ring = _sq_ring;
+    if (!(_params.features & IORING_FEAT_SINGLE_MMAP)) {
+      _cq_ring = mmap(0, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+      if (_cq_ring == MAP_FAILED) error("Cannot map the completion queue");
     }
 
-    return true;
+    _sqes_size = _params.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = (struct io_uring_sqe*)mmap(0, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED) error("Cannot map the submission entries");
+
+    char* sq = (char*)_sq_ring;
+    _sq_head       = (unsigned*)(sq + _params.sq_off.head);
+    _sq_tail       = (unsigned*)(sq + _params.sq_off.tail);
+    _sq_array      = (unsigned*)(sq + _params.sq_off.array);
+    _sq_mask       = *(unsigned*)(sq + _params.sq_off.ring_mask);
+    _sq_local_tail = *_sq_tail;
+
+    char* cq = (char*)_cq_ring;
+    _cq_head = (unsigned*)(cq + _params.cq_off.head);
+    _cq_tail = (unsigned*)(cq + _params.cq_off.tail);
+    _cq_mask = *(unsigned*)(cq + _params.cq_off.ring_mask);
+    _cqes    = (struct io_uring_cqe*)(cq + _params.cq_off.cqes);
+
+    // Provide the receive buffers
+    _buf_ring_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+    _buf_ring = (struct io_uring_buf_ring*)mmap(0, _buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (_buf_ring == MAP_FAILED) error("Cannot allocate the receive buffer ring");
+    _bufs = (struct io_uring_buf*)_buf_ring;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)_buf_ring;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid         = RECV_GROUP;
+    if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) 
+      error("Cannot register the receive buffer ring");
+
+    _recv_data.resize(RECV_BUFFERS * MAX_UDP_SIZE);
+    for (unsigned bid = 0; bid < RECV_BUFFERS; recycle(bid++));
   }
 
- /// Delete domains
-  bool deleteDomains(Domains& domains) {
+/// Open the sockets then register a send buffer covering all their slots
+  bool open(Domains& domains) {
+    DatagramEngine::open(domains);
+    registerSendBuffer();
+    submit();
+    return true;
+  }
 
-    if (!domains.size()) return false; 
+/**
+* @brief Queue a DNS query for a random target of the domain
+*/
+  bool send(Domain& domain) {
 
-    std::stringstream sql;
-    sql <<  "DELETE FROM domain WHERE ";
-    
-    int i = 0;    
-    for (const auto& domain : domains){
-      if (i > 0) sql << " OR "; 
-      sql << "( name='" << domain.getName()<< "')";
-      i++;
-    }
-    sql << ";";
+    uint32_t slot;
+    const uint8_t* packet;
+    size_t size = 0;
+    if (!prepare(domain, slot, packet, size)) return false;
 
-    Log::write("Deleting domains with query { " + sql.str() + " }", Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    uint8_t* buffer = &_send_data[slot * QUERY_SIZE];
+    memcpy(buffer, packet, size);
 
-    // Execute the SQL statement
-    mysqlpp::Query query = _connection.query(sql.str()); 
-    if (! query.execute()) {
-      std::stringstream msg;
-      msg <<  "Failed to execute SQL statement: " << query.error();
-      Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
-    }
+    struct io_uring_sqe* sqe = getSqe();
+    sqe->opcode    = _fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd        = _sockets[slot >> SLOT_BITS];
+    sqe->addr      = (uint64_t)buffer;
+    sqe->len       = size;
+    sqe->flags     = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = (OP_WRITE << 48) | (uint64_t(_slots[slot].id) << 32) | slot;
 
+    _staged.push_back(slot);
     return true;
   }
 
- /// Update domains and insert measurements
-  bool saveDomains(Domains& domains) {
+/**
+* @brief Submit the queued queries at once
+*/
+  void flush() {
 
-    if (!domains.size()) return false; 
-  
-    // Update domains
-    for (const auto& domain : domains) {
+    if (_staged.empty()) return;
 
-      std::stringstream sql;
-      sql <<  "UPDATE domain SET name = '" << domain.getName() 
-          << "', query_time_avg = " << domain.getQueryTimeAvg() << ", query_time_stddev = " << domain.getQueryTimeStdDev() 
-          << ", query_count = " << domain.getQueryCount() 
-          << ", time_first = FROM_UNIXTIME("  << domain.getTimeFirst() << "), time_last = FROM_UNIXTIME("  << domain.getTimeLast() << ") WHERE rank = " 
-          << domain.getRank() << ";\n";
-         
-      Log::write("Updating domains with query { " + sql.str() + " }", Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
-    
-      // Execute the SQL statement
-      mysqlpp::Query query  = _connection.query(sql.str());
-      if (! query.execute()) {
-         std::stringstream msg;
-        msg <<  "Failed to execute SQL statement: " << query.error();
-        Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
-      }
-    }
+    submit();
 
-    // Insert measurements  
-    std::stringstream sql;
-    sql <<  "INSERT INTO measurement (time, target, type, duration_ms, domain_rank) VALUES \n";
+    double start = monotonicTime();
+    for (uint32_t slot : _staged) started(slot, start);
+    _staged.clear();
+  }
 
-    int i = 0;    
-    for (auto& domain : domains) {
-      while (!domain.getEvents().empty()) {
+  void watch(int fd) {
+    ProbeEngine::watch(fd);
+    armWatch();
+    submit();
+  }
 
-        auto event = domain.getEvents().front();
-        if (i > 0) sql << ","; 
-        sql << "(FROM_UNIXTIME(" << event.time << "),'" << event.target << "'," << event.event << "," << event.duration << "," << domain.getRank() << ")\n";
-        i++;
-        domain.getEvents().pop();
-      } 
-    }
-    sql << ";";
+/**
+* @brief Wait for replies until something completes, timeout ms elapse or the watched descriptor is ready
+*/
+  size_t poll(Time timeout) {
 
-    // Execute the SQL statement
-    mysqlpp::Query query  = _connection.query(sql.str());
-    if (! query.execute()) {
-      
-      std::stringstream msg;
-      msg <<  "Failed to execute SQL statement: " << query.error();
-      Log::write(msg.str(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    flush();
+
+    size_t count = reap() + expire();
+
+    if (!count) {
+      __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+      enter(_to_submit, 1, IORING_ENTER_GETEVENTS, getWaitTime(timeout));
+      _to_submit = 0;
+      count += reap() + expire();
     }
 
-    Log::write("Inserting measurements with query { " + sql.str() + " }", Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+    return count;
+  }
 
-    return true;
+  ~UringEngine() {
+    munmap(_buf_ring, _buf_ring_size);
+    munmap(_sqes, _sqes_size);
+    if (_cq_ring != _sq_ring) munmap(_cq_ring, _cq_ring_size);
+    munmap(_sq_ring, _sq_ring_size);
+    close(_ring_fd);
   }
 };
 
-//============================== Network communication ==================================//
 /**
-* @brief Remote host reply
+* @brief Create the engine selected by the settings
 */
-struct Reply {
-  Time time;
-  std::string target;
-  EventType event;
-  double duration;
-};
-
+inline ProbeEngine* createEngine(const EngineConfig& config) {
+  switch (config.type) {
+    case ENGINE_LDNS:  return new LdnsEngine;
+    case ENGINE_MMSG:  return new EpollEngine(config, true);
+    case ENGINE_URING: return new UringEngine(config);
+    default:           return new EpollEngine(config);
+  }
+}
 
+  
+//============================== Scheduling ==================================//
 /**
-* @brief Remote Query abstract class
+* @brief Hierarchical timing wheel
+* Timers are dense ids from 0 to size - 1 that expire at a tick. The root 
+* wheel has one slot per tick and every slot of an upper level covers the 
+* whole range of the level below. Timers of an upper slot cascade down when
+* the root wheel wraps around to it, so scheduling, cancelling and firing a 
+* timer are O(1) whatever the number of timers.
 */
-class RemoteQuery {
+class TimerWheel {
 
-protected:
+  static const unsigned ROOT_BITS  = 8;
+  static const unsigned LEVEL_BITS = 6;
+  static const unsigned LEVELS     = 5;
+  static const uint64_t ROOT_SIZE  = 1 << ROOT_BITS;
+  static const uint64_t LEVEL_SIZE = 1 << LEVEL_BITS;
 
-  std::shared_ptr<Domain> _p_domain;
+  /// Farthest expiry a timer can be placed at, farther timers are placed there and cascade again
+  static const uint64_t MAX_DELTA  = uint64_t(1) << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS);
 
-public:
+  static const uint32_t NONE       = ~0u;
 
-  RemoteQuery(Domain& domain): _p_domain(&domain) {}
+  /// Next tick to be processed
+  uint64_t _tick;
 
-/**
-* @brief Send a query
-*/
-  virtual std::pair<Reply,bool> sendQuery()= 0;
+  // Slot lists, root wheel first
+  std::vector<uint32_t> _heads;
 
-/**
-* @brief Probe a target
-*/
-  bool probe(){
+  // Per timer links, slot and expiry
+  std::vector<uint32_t> _next;
+  std::vector<uint32_t> _prev;
+  std::vector<uint32_t> _slot;
+  std::vector<uint64_t> _expiry;
 
-    // Send query
-    std::pair<Reply,bool> reply = sendQuery();
-    
-    // Process reply      
-    if (!reply.second) {
-      Log::write("Cannot send query to " + _p_domain->getName(), Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+/// Slot of an expiry relative to the next tick
+  uint32_t getSlot(uint64_t expiry) const {
+
+    uint64_t delta = expiry > _tick ? expiry - _tick : 0;
+    if (delta >= MAX_DELTA) {
+      delta  = MAX_DELTA - 1;
+      expiry = _tick + delta;
     }
-    
-     // Update the domain
-    _p_domain->update({reply.first.time, reply.first.target, reply.first.event, reply.first.duration}); 
+    if (delta < ROOT_SIZE) return std::max(expiry, _tick) & (ROOT_SIZE - 1);
 
-    return  reply.second;
+    unsigned level = 1;
+    for (; delta >= uint64_t(1) << (ROOT_BITS + level * LEVEL_BITS); level++);
+
+    unsigned shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+    return ROOT_SIZE + (level - 1) * LEVEL_SIZE + ((expiry >> shift) & (LEVEL_SIZE - 1));
   }
 
-  ~RemoteQuery(){}
-};
+  void link(uint32_t timer) {
+    uint32_t slot = getSlot(_expiry[timer]);
+    _slot[timer] = slot;
+    _prev[timer] = NONE;
+    _next[timer] = _heads[slot];
+    if (_heads[slot] != NONE) _prev[_heads[slot]] = timer;
+    _heads[slot] = timer;
+  }
 
-typedef std::unordered_map<std::string, std::shared_ptr<RemoteQuery> > RemoteQueries;
+  void unlink(uint32_t timer) {
+    if (_prev[timer] != NONE) 
+      _next[_prev[timer]] = _next[timer];
+    else 
+      _heads[_slot[timer]] = _next[timer];
+    if (_next[timer] != NONE) _prev[_next[timer]] = _prev[timer];
+    _slot[timer] = NONE;
+  }
+
+/// Detach the list of a slot and return its head
+  uint32_t detach(uint32_t slot) {
+    uint32_t head = _heads[slot];
+    _heads[slot] = NONE;
+    return head;
+  }
+
+/// Move the timers of an upper slot to the levels below
+  void cascade(uint32_t slot) {
+    for (uint32_t timer = detach(slot), next; timer != NONE; timer = next) {
+      next = _next[timer];
+      link(timer);
+    }
+  }
+
+public:
+
+  TimerWheel(): _tick(0), _heads(ROOT_SIZE + (LEVELS - 1) * LEVEL_SIZE, uint32_t(NONE)) {}
+
+/// Set the number of timers and the current tick, this cancels every timer
+  void reset(size_t timers, uint64_t tick) {
+    _tick = tick;
+    std::fill(_heads.begin(), _heads.end(), uint32_t(NONE));
+    _next.assign(timers, uint32_t(NONE));
+    _prev.assign(timers, uint32_t(NONE));
+    _slot.assign(timers, uint32_t(NONE));
+    _expiry.assign(timers, 0);
+  }
+
+  bool isScheduled(uint32_t timer) const { return _slot[timer] != NONE; }
+  uint64_t getExpiry(uint32_t timer) const { return _expiry[timer]; }
+  uint64_t getTick() const { return _tick; }
+
+/// Earliest tick that may fire a timer: the first busy root slot or the next cascade
+  uint64_t getNextTick() const {
+    uint64_t tick = _tick;
+    if (!(tick & (ROOT_SIZE - 1))) return tick;
+    for (; tick & (ROOT_SIZE - 1); tick++) 
+      if (_heads[tick & (ROOT_SIZE - 1)] != NONE) return tick;
+    return tick;
+  }
 
+/// Schedule or reschedule a timer, past expiries fire at the next tick
+  void schedule(uint32_t timer, uint64_t expiry) {
+    if (isScheduled(timer)) unlink(timer);
+    _expiry[timer] = expiry;
+    link(timer);
+  }
+
+  void cancel(uint32_t timer) {
+    if (isScheduled(timer)) unlink(timer);
+  }
 
 /**
-* @brief DNS Query implementation class
+* @brief Process every tick up to the given one
+* fire(timer, expiry) is called for each expired timer, it may reschedule it,
+* a past expiry then fires at the next tick.
 */
-class DNSQuery : public RemoteQuery {
+  template <class Fire> 
+  size_t advance(uint64_t tick, Fire fire) {
 
-  ldns_resolver* _ns_resolver;
-  ldns_rdf* _ns_name;
-  ldns_rr_list* _ns_addresses;
+    size_t count = 0;
+
+    while (_tick <= tick) {
+      uint64_t current = _tick;
+      uint64_t index = current & (ROOT_SIZE - 1);
+
+      // Cascade upper levels when the wheel below wraps around
+      for (unsigned level = 1; !index && level < LEVELS; level++) {
+        unsigned shift = ROOT_BITS + (level - 1) * LEVEL_BITS;
+        index = (current >> shift) & (LEVEL_SIZE - 1);
+        cascade(ROOT_SIZE + (level - 1) * LEVEL_SIZE + index);
+      }
+
+      // The slot of the current tick is detached, timers linked from now on go to the next ticks
+      uint32_t timer = detach(current & (ROOT_SIZE - 1)), next;
+      _tick = current + 1;
+
+      for (; timer != NONE; timer = next) {
+        next = _next[timer];
+        _slot[timer] = NONE;
+
+        // Timers beyond the wheel range come around before they expire
+        if (_expiry[timer] > current) {
+          link(timer);
+          continue;
+        }
+
+        fire(timer, _expiry[timer]);
+        count++;
+      }
+    }
+
+    return count;
+  }
+};
+
+  
+//============================== Probe workers ==================================//
+/**
+* @brief Probe worker
+* A worker runs on its own thread and owns a shard of the domains and the
+* engine probing them. The only traffic leaving the thread is the hand-off 
+* of finished measurements to the persistence callback.
+*/
+class ProbeWorker {
 
 public:
 
-  DNSQuery(Domain& domain) throw (std::runtime_error) : RemoteQuery(domain) { 
-    // Initialize ldns variables
-    _ns_name = ldns_dname_new_frm_str(_p_domain->getName().c_str());
+  /// Hand measurements over without waiting, returns false when they have to stay with the worker. The last hand-over may wait for the writer to make room.
+  typedef std::function<bool(Domains&, DomainTable&, bool)> SaveCallback;
 
-    if (ldns_resolver_new_frm_file(&_ns_resolver, NULL) != LDNS_STATUS_OK) {
-        const char * message = "Cannot create a resolver. Exiting..";
-        Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
-        throw std::runtime_error(message);
+private:
+
+  size_t _index;
+  Domains _domains;
+  DomainTable _table;
+  std::shared_ptr<ProbeEngine> _engine;
+  Time _probe_interval;
+  double _dbupdate_freq;
+  const std::atomic<bool>* _flag_stop;
+  SaveCallback _save;
+  TimerWheel _wheel;
+  std::thread _thread;
+
+  // Tick timer watched by the engine, and the tick it is armed for
+  int _timer_fd;
+  Time _timer_tick;
+
+  // Scheduler lag: how late probes leave compared to their schedule, in ms, 
+  // since the last report and since the start
+  DDSketch _lag;
+  DDSketch _lag_total;
+  double _lag_sum;
+  double _lag_max;
+
+/// Probe interval of a domain
+  Time getInterval(const Domain& domain) const {
+    return std::max(Time(1), domain.getProbeInterval() ? domain.getProbeInterval() : _probe_interval);
+  }
+
+/// Arm the timer at an absolute monotonic time in ms
+  void arm(Time tick) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec  = tick / 1000;
+    spec.it_value.tv_nsec = (tick % 1000) * 1000000;
+    timerfd_settime(_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    _timer_tick = tick;
+  }
+
+/// Log the engine throughput and the scheduler lag since the given stats were taken
+  void report(const EngineStats& before, double start) {
+
+    const EngineStats& after = _engine->getStats();
+    double elapsed = monotonicTime() - start;
+    size_t queries = after.queries - before.queries;
+
+    if (queries && Log::isEnabled(Log::LOG_INFO)) {
+      std::stringstream msg;
+      msg << "Worker #" << _index << " probed " << queries << " domains in " << elapsed << " ms: " << queries * 1e+3 / elapsed << " probes/s, " 
+          << double(after.syscalls - before.syscalls) / queries << " syscalls/probe, " 
+          << after.timeouts - before.timeouts << " timeouts, " << after.errors - before.errors << " errors, "
+          << "scheduler lag avg " << (_lag.getTotal() ? _lag_sum / _lag.getTotal() : 0) << " ms p50 " << _lag.getPercentile(0.5) 
+          << " ms p99 " << _lag.getPercentile(0.99) << " ms max " << _lag_max << " ms";
+
+      StreamingMoments query_time = _table.aggregate();
+      msg << ", query time avg " << query_time.getMean() << " ms stddev " << query_time.getStdDev() << " ms over " << query_time.getCount() << " replies";
+      Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
     }
-    
-    // Set the number of retries
-    ldns_resolver_set_retry(_ns_resolver, DEFAULT_DNS_RETRY);
+
+    _lag_total.merge(_lag);
+    _lag = DDSketch();
+    _lag_sum = _lag_max = 0;
   }
 
 /**
-* @brief Send a DNS query
+* @brief Worker thread: probe every domain at its own interval and hand measurements over periodically
+* The engine waits for replies and for the tick timer at once, the timer being
+* armed at the next tick of the wheel that may fire or at the next hand-over.
 */
-  std::pair<Reply,bool> sendQuery() {
+  void run() {
 
-    Reply reply;
-    // By default the event is the request. It is updated by the reply if any.
-    reply.target   = _p_domain->getRandomTarget() + "." + _p_domain->getName();
-    reply.time     = time(0);
-    reply.event    = EV_SEND_REQUEST;
+    // Statistics move to the table, dense ids being the indexes in the shard
+    _table.reserve(_domains.size());
+    for (auto& domain : _domains) domain.bind(_table);
 
-    Log::write("Sending query for " + reply.target, Log::LOG_INFO, __FUNCTION__, __LINE__); 
+    Time now = Time(monotonicTime());
+    _wheel.reset(_domains.size(), now);
 
-    ldns_rdf* target_name = ldns_dname_new_frm_str(_p_domain->getName().c_str());
+    // Spread the first probes over their interval following the golden ratio sequence 
+    // so that domains sharing an interval are evenly apart whatever their number
+    for (size_t index = 0; index < _domains.size(); index++) {
+      double phase = fmod(index * 0.6180339887498949, 1.);
+      _wheel.schedule(index, now + Time(phase * getInterval(_domains[index])));
+    }
 
-    ldns_pkt* packet = NULL;
-    struct timespec start_time, end_time;
-    
-    // Measure query duration
-    clock_gettime(CLOCK_REALTIME, &start_time);
-    ldns_status query_status = ldns_resolver_query_status(&packet, _ns_resolver, target_name, LDNS_RR_TYPE_A, LDNS_RR_CLASS_CH, LDNS_RD);
-    clock_gettime(CLOCK_REALTIME, &end_time);
+    Time save_period = std::max(Time(1), Time(_dbupdate_freq * _probe_interval));
+    Time next_save = now + save_period;
+    EngineStats stats = _engine->getStats();
+    double stats_time = monotonicTime();
+
+    while (!*_flag_stop) {
+      double time = monotonicTime();
+      now = Time(time);
+
+      // Send the queries due by now and schedule the next ones, skipping the probes already missed
+      _wheel.advance(now, [this, now, time](uint32_t index, uint64_t expiry) {
+        Domain& domain = _domains[index];
+        Time interval = getInterval(domain);
+        _engine->send(domain);
+        _wheel.schedule(index, expiry + interval * ((now - expiry) / interval + 1));
+
+        double lag = time - expiry;
+        _lag.add(lag);
+        _lag_sum += lag;
+        _lag_max = std::max(_lag_max, lag);
+      });
+      _engine->flush();
+
+      if (now >= next_save) {
+        report(stats, stats_time);
+        stats = _engine->getStats();
+        stats_time = monotonicTime();
+
+        // A busy writer leaves the events with the domains until the next hand-over
+        if (!_save(_domains, _table, false)) 
+          Log::write("Worker #" + std::to_string(_index) + " deferred its measurements, the database writer is busy", Log::LOG_WARN, __FUNCTION__, __LINE__); 
+        next_save = std::max(next_save + save_period, now);
+      }
 
-    const double  SEC_TO_MILLI  = 1e+3;
-    const double  MILLI_TO_NANO = 1e+3;
-    
-    // Set the duration in ms
-    reply.duration = (end_time.tv_sec - start_time.tv_sec) * SEC_TO_MILLI  + (end_time.tv_nsec - start_time.tv_nsec) / MILLI_TO_NANO;
+      // Replies arriving before the tick only re-arm the timer when it already went off
+      Time tick = std::min(Time(_wheel.getNextTick()), next_save);
+      if (tick != _timer_tick || now >= _timer_tick) {
+        arm(tick);
 
-    if (packet && ldns_pkt_qr(packet)) {
-        // If a packet was received
-        reply.event = EV_RECV_DATA;
+        // A wake-up may have been overwritten
+        if (*_flag_stop) break;
+      }
 
-        std::string reply_ns_str;          
-        if (query_status == LDNS_STATUS_OK) {
-          // Update timestamp
-          struct timeval timev = ldns_pkt_timestamp(packet);
-          reply.time = timev.tv_sec; 
-        
-          //Update duration
-          reply.duration  = ldns_pkt_querytime(packet);
+      _engine->poll(next_save - now);
+    }
 
-          // Get name server name
-          ldns_rdf* reply_ns =  ldns_pkt_answerfrom(packet);
-          char* str = ldns_rdf2str(reply_ns);
-          reply_ns_str = " from " + std::string(str);
-          LDNS_FREE(str);
-        }
-        std::stringstream msg;
-        msg << "Got answer" << reply_ns_str << " with status: { " << ldns_get_errorstr_by_id(query_status) << " } in " << reply.duration << " ms"; 
-        Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+    // Hand the last measurements over once the queries in flight complete
+    while (_engine->pending()) 
+      _engine->poll(DEFAULT_DNS_TIMEOUT);
+    if (!_save(_domains, _table, true))
+      Log::write("Worker #" + std::to_string(_index) + " gave its last measurements up, the database writer is stopping", Log::LOG_ERROR, __FUNCTION__, __LINE__); 
+    _lag_total.merge(_lag);
+    _lag = DDSketch();
+  }
 
-        ldns_pkt_free(packet);
+public:
+
+  ProbeWorker(size_t index): _index(index), _probe_interval(DEFAULT_PROBE_INTERVAL), _dbupdate_freq(DEFAULT_DB_UPDATE_FREQ), _flag_stop(nullptr), 
+    _timer_fd(-1), _timer_tick(0), _lag_sum(0), _lag_max(0) {}
+
+/// Give access to the shard, it must not change once the worker is started
+  Domains& getDomains() { return _domains; }
+
+/// Scheduler lag of every probe in ms, to be read once the worker is joined
+  const DDSketch& getLag() const { return _lag_total; }
+
+/// Engine counters, to be read once the worker is joined
+  const EngineStats& getEngineStats() const { return _engine->getStats(); }
+
+/// Open the engine on the shard and the tick timer it watches
+  void open(const EngineConfig& engine) {
+    _engine.reset(createEngine(engine));
+    _engine->open(_domains);
+
+    if ((_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+      const char * message = "Cannot create the tick timer. Exiting..";
+      Log::write(message, Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      throw std::runtime_error(message);
     }
+    _engine->watch(_timer_fd);
+  }
 
-    ldns_rdf_deep_free(target_name); 
+/// Launch the worker thread, pinned to a core
+  void start(Time probe_interval, double dbupdate_freq, const std::atomic<bool>& flag_stop, const SaveCallback& save) {
 
-    return std::make_pair(reply, true);
-  };
+    _probe_interval = probe_interval;
+    _dbupdate_freq  = dbupdate_freq;
+    _flag_stop      = &flag_stop;
+    _save           = save;
+    _thread         = std::thread(&ProbeWorker::run, this);
 
-  ~DNSQuery() {
-    // Free LDNS resources
-    Log::write("Free LDNS resources for domain " + _p_domain->getName(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
-    for (;ldns_rdf *ns = ldns_resolver_pop_nameserver(_ns_resolver); ldns_rdf_deep_free(ns));
-    ldns_rdf_deep_free(_ns_name); 
-    ldns_resolver_deep_free(_ns_resolver); 
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(_index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+    pthread_setaffinity_np(_thread.native_handle(), sizeof(cpus), &cpus);
+
+    std::stringstream msg;
+    msg << "Worker #" << _index << " started with " << _domains.size() << " domains";
+    Log::write(msg.str(), Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
+  }
+
+/// Make the worker check the stop flag right away, safe from any thread
+  void wake() {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_nsec = 1;
+    timerfd_settime(_timer_fd, 0, &spec, NULL);
+  }
+
+/// Wait for the worker thread to finish
+  void join() {
+    if (_thread.joinable()) _thread.join();
+  }
+
+  ~ProbeWorker() {
+    join();
+    if (_timer_fd >= 0) close(_timer_fd);
   }
 };
 
+typedef std::vector<std::shared_ptr<ProbeWorker> > ProbeWorkers;
+
   
 //============================== Vantage Point ==================================//
 /**
 * @brief Local Vantage Point
-* This class is a singleton
+* This class is a singleton. Domains are sharded across probe workers and
+* the persistence layer is shared by all of them.
 */
 class Vantage {
 
   Time _probe_interval;
   double _dbupdate_freq;
   Domains _domains;
-  RemoteQueries _remoteQueries;
+  ProbeWorkers _workers;
   std::shared_ptr<DBAccess> _dbaccess;
-  bool _flag_stop;
+  std::shared_ptr<DBWriter> _writer;
+  std::atomic<bool> _flag_stop;
 
   Vantage(){}
 
 
 public:
 
-  /// Launch Vantage point
-  bool start(const std::shared_ptr<DBAccess>& dbaccess, Time probe_interval = DEFAULT_PROBE_INTERVAL, double dbupdate_freq = DEFAULT_DB_UPDATE_FREQ) {
+  /// Launch Vantage point with one worker per core by default
+  bool start(const std::shared_ptr<DBAccess>& dbaccess, Time probe_interval = DEFAULT_PROBE_INTERVAL, double dbupdate_freq = DEFAULT_DB_UPDATE_FREQ, EngineConfig engine = EngineConfig(), size_t workers = 0) {
 
 
     _dbaccess = dbaccess;
@@ -610,82 +5110,96 @@ public:
       return false;
     }
 
-    for (auto& domain : _domains) 
-      _remoteQueries.insert(std::make_pair(domain.getName(), std::shared_ptr<RemoteQuery>(new DNSQuery(domain))));
+    // Shard domains across workers
+    if (!workers) workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, _domains.size());
 
-    
-    // Set signal handlers
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = sigHandler;
+    for (size_t index = 0; index < workers; index++) {
+      _workers.push_back(std::shared_ptr<ProbeWorker>(new ProbeWorker(index)));
+      _workers.back()->getDomains().reserve(_domains.size() / workers + 1);
+    }
+
+    for (size_t index = 0; index < _domains.size(); index++) 
+      _workers[index % workers]->getDomains().push_back(std::move(_domains[index]));
+    Domains().swap(_domains);
+
+    // Queries time out before the next probe of a domain at the vantage interval
+    engine.timeout = std::min(engine.timeout, probe_interval);
+    for (auto& worker : _workers) 
+      worker->open(engine);
 
-    // Probe periodically
-    sigaction(SIGALRM, &act, NULL); 
-    
-    // Save stats on interrupt
-    sigaction(SIGINT , &act, NULL); 
-    sigaction(SIGHUP, &act, NULL); 
-    sigaction(SIGTERM, &act, NULL); 
-
-
-    // Install the alarm
-    struct itimerval itimer;
-    itimer.it_value.tv_sec     = 
-    itimer.it_interval.tv_sec  = _probe_interval / 1000; 
-    itimer.it_value.tv_usec    = 
-    itimer.it_interval.tv_usec = (_probe_interval % 1000) * 1000;
     
-    setitimer(ITIMER_REAL, &itimer, NULL);
+    // Shutdown signals are read from a descriptor rather than handled asynchronously, 
+    // worker threads inherit a mask blocking every signal
+    sigset_t signals, old_signals, all_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGTERM);
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    if (signal_fd < 0) {
+      pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+      Log::write(std::string("Cannot watch shutdown signals: ") + strerror(errno), Log::LOG_FATAL, __FUNCTION__, __LINE__); 
+      return false;
+    }
 
-    probe();
+    _writer.reset(new DBWriter(_dbaccess, std::max(DEFAULT_DB_QUEUE_SIZE, 2 * workers)));
+    _writer->start();
 
-    // Infinite loop
-    for (;!_flag_stop;sleep(1)); 
-  };
+    for (auto& worker : _workers) 
+      worker->start(_probe_interval, _dbupdate_freq, _flag_stop, [this](Domains& domains, DomainTable& table, bool last) { return save(domains, table, last); });
 
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-  /// Signal handler 
-  static void sigHandler(int sig) {
-    // Counts the number of SIGALRM for triggering buffer flush 
-    static size_t alarm_counter = 0;
+    // Wait for an interruption
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) != sizeof(info) && errno == EINTR);
+    Log::write(std::string("Caught signal ") + strsignal(info.ssi_signo) + ", stopping", Log::LOG_INFO, __FUNCTION__, __LINE__); 
 
-    switch(sig) {
-      case SIGALRM: 
-                    alarm_counter++;
-                    if (alarm_counter >= getInstance()._dbupdate_freq) {
-                      getInstance().save(); 
-                      alarm_counter = 0;
-                    }
-                    getInstance().probe();
-                    Log::write("SIGALRM fired", Log::LOG_DEBUG, __FUNCTION__, __LINE__);
-                    break;
-      case SIGINT : 
-      case SIGHUP : 
-      case SIGTERM: Log::write("Application interrupted." , Log::LOG_DEBUG, __FUNCTION__, __LINE__); 
-                    getInstance().stop();
-      default:      break;
-    }
-  }
+    stop();
+    for (auto& worker : _workers) 
+      worker->join();
+
+    // Write the last snapshots
+    _writer->stop();
+
+    DBWriterStats stats = _writer->getStats();
+    std::stringstream msg;
+    msg << "Database writer saved " << stats.flushes << " snapshots of " << stats.domains << " domains and " << stats.events << " events, " 
+        << stats.rejected << " turned down, " << stats.failures << " failed writes, " << stats.lost << " events lost, queue depth max " << stats.queue_depth_max << ", flush time avg " 
+        << (stats.flushes ? stats.flush_time_sum / stats.flushes : 0) << " ms max " << stats.flush_time_max << " ms";
+    Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+
+    // Lags of all the workers merged
+    DDSketch lag;
+    for (auto& worker : _workers) lag.merge(worker->getLag());
+    msg.str("");
+    msg << "Scheduler lag over " << lag.getTotal() << " probes: p50 " << lag.getPercentile(0.5) << " ms p99 " << lag.getPercentile(0.99) 
+        << " ms p99.9 " << lag.getPercentile(0.999) << " ms";
+    Log::write(msg.str(), Log::LOG_INFO, __FUNCTION__, __LINE__); 
+
+    close(signal_fd);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
 
-  /// Save domains on interruption 
-  void save() {
-     _dbaccess->saveDomains(_domains);
+    return true;
+  };
+
+
+  /// Queue a snapshot of the domains of a worker for the database writer
+  bool save(Domains& domains, DomainTable& table, bool last = false) {
+    return _writer->push(domains, table, last);
   }
 
-  /// Stop probing
+  /// Stop probing, workers save their domains before they exit while the writer bounds its retries
   void stop() {
-    save();
     _flag_stop = true;
-  }
-
-  /// Probe domains
-  void probe() {
-    Log::write("Probing all...", Log::LOG_DEBUG, __FUNCTION__, __LINE__);
-
-    // Create Remote queries for every domain
-    for (auto& remoteQuery : _remoteQueries)
-      remoteQuery.second->probe();
-    
+    if (_writer) _writer->beginStop();
+    for (auto& worker : _workers) 
+      worker->wake();
   }
 
 /**
@@ -10,6 +10,7 @@
 
 #include <iostream>
 #include <iomanip>
+#include <mutex>
 #include <unistd.h>
 /**
 * @brief Program Logger as a static class
@@ -81,13 +82,22 @@ public:
     return str;
   }
 
+/**
+* @brief Tell whether messages of a severity are printed, to skip formatting them otherwise
+*/
+  static bool isEnabled(Severity severity) { return LOG_LEVEL <= severity; }
+
 /**
 * @brief Logger main function, writes logs to stderr
+* Threads take turns so that lines are not interleaved
 */ 
   static void write(const std::string& message, Severity severity = LOG_INFO, const char* function = "", int line = 0){
     
     // Ignore message if the severity is not enough
-    if (LOG_LEVEL > severity) return;
+    if (!isEnabled(severity)) return;
+
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
     
     // Print message otherwise
     std::cerr << "[" << std::setfill('0') << std::setw(6) << getSize() << "] " 
@@ -0,0 +1,174 @@
+/**
+* @file columnar_test.cpp
+* @brief Round trip and decoder benchmark of the columnar series segments
+*
+* Adversarial records (rank and time extremes, time going backwards,
+* durations of every magnitude, every type, escaped label characters) must
+* decode to what was encoded, durations within the microsecond. Corrupt
+* encodings must be turned down or decode without faulting. The benchmark
+* then decodes realistic flushes and reports the compression ratio and MB/s
+* of the records produced.
+*
+* To compile, type: "g++ -std=c++11 -O2 -o columnar_test tests/columnar_test.cpp -I. -I /usr/include/mysql++ -I /usr/include/mysql -L/usr/lib -L/usr/local/lib -lmysqlpp -lldns -lsqlite3 -pthread"
+*/
+
+#include <iostream>
+#include <random>
+#include "dnsprobe.h"
+
+int Log::LOG_LEVEL = LOG_WARN;
+
+using namespace dnsprobe;
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition << std::endl; failures++; } } while (0)
+
+/// Encode then decode, the records must come back
+static void roundTrip(const std::vector<SeriesRecord>& records, bool labels) {
+
+  std::vector<uint8_t> data;
+  ColumnarSegment::encode(records.data(), records.size(), labels, data);
+
+  std::vector<SeriesRecord> decoded;
+  CHECK(ColumnarSegment::decode(data.data(), data.size(), decoded));
+  CHECK(decoded.size() == records.size());
+  if (decoded.size() != records.size()) return;
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    const SeriesRecord& a = records[i];
+    const SeriesRecord& b = decoded[i];
+    bool same = a.time == b.time && a.rank == b.rank && a.type == b.type && fabs(a.duration - b.duration) <= 0.5e-3 + fabs(a.duration) * 1e-15;
+    if (labels) same = same && a.label_length == b.label_length && !memcmp(a.label, b.label, a.label_length);
+    if (!same && !mismatches++)
+      std::cerr << "record " << i << ": time " << a.time << "/" << b.time << " rank " << a.rank << "/" << b.rank
+                << " type " << int(a.type) << "/" << int(b.type) << " duration " << a.duration << "/" << b.duration << std::endl;
+  }
+  CHECK(!mismatches);
+}
+
+static SeriesRecord record(uint64_t time, uint64_t rank, double duration, uint8_t type, const std::string& label) {
+  SeriesRecord r;
+  memset(&r, 0, sizeof(r));
+  r.time = time;
+  r.rank = rank;
+  r.duration = duration;
+  r.type = type;
+  r.label_length = std::min(label.size(), sizeof(r.label));
+  memcpy(r.label, label.data(), r.label_length);
+  return r;
+}
+
+static void testAdversarial() {
+
+  std::vector<SeriesRecord> records;
+
+  // Empty and single record segments
+  roundTrip(records, true);
+  records.push_back(record(0, 0, 0, 0, ""));
+  roundTrip(records, true);
+
+  // Extremes of every field
+  records.push_back(record(UINT64_MAX, UINT64_MAX, 1e+12, 255, "zzzzzzzzzz"));
+  records.push_back(record(0, 1, -1e+12, 0, "0"));
+  records.push_back(record(UINT64_MAX / 2, UINT64_MAX - 1, 0.0004, 128, "--------"));
+  records.push_back(record(1, 0, 0.0006, 1, std::string("\x00\xff\x7f.A_", 7)));
+  records.push_back(record(1, 0, 4.5e+15, 2, "ABCDEFGHIJ"));
+  roundTrip(records, true);
+  roundTrip(records, false);
+
+  // Times going backwards within a rank run, equal times, huge jumps
+  records.clear();
+  uint64_t times[] = {1000, 999, 999, 1000000000000ULL, 5, UINT64_MAX, 0, 7};
+  for (uint64_t time : times) records.push_back(record(time, 42, 1.5, EV_RECV_DATA, "abc"));
+  roundTrip(records, true);
+
+  // Random fields: every rank run length, duration window and escaped character
+  std::mt19937_64 random(15);
+  records.clear();
+  for (size_t i = 0; i < 100000; i++) {
+    std::string label(random() % 11, ' ');
+    for (auto& c : label) c = char(random() % 4 ? "abcdefghijklmnopqrstuvwxyz0123456789-"[random() % 37] : random());
+    double duration = (random() % 3 ? double(random() % 2000000) : double(int64_t(random() >> 12))) / 1e+3;
+    records.push_back(record(random() % 8 ? 1700000000000ULL + i : random(), random() % 4 ? 1 + random() % 50 : random(),
+                             random() % 2 ? -duration : duration, random(), label));
+  }
+  roundTrip(records, true);
+  roundTrip(records, false);
+}
+
+static void testCorruption() {
+
+  std::mt19937_64 random(51);
+  std::vector<SeriesRecord> records;
+  for (size_t i = 0; i < 5000; i++)
+    records.push_back(record(1700000000000ULL + i / 50 * 1000, 1 + i % 50, (random() % 100000) / 1e+3, random() % 3, "label"));
+
+  std::vector<uint8_t> data, broken;
+  ColumnarSegment::encode(records.data(), records.size(), true, data);
+  std::vector<SeriesRecord> decoded;
+
+  // Truncated or resized encodings are turned down
+  CHECK(!ColumnarSegment::decode(data.data(), sizeof(ColumnarSegment::Header) - 1, decoded));
+  CHECK(!ColumnarSegment::decode(data.data(), data.size() - 1, decoded));
+
+  // Flipped bits in the columns may decode to anything but must not fault
+  for (int round = 0; round < 2000; round++) {
+    broken = data;
+    for (int flip = 0; flip < 1 + round % 8; flip++) {
+      size_t bit = sizeof(ColumnarSegment::Header) * 8 + random() % ((broken.size() - sizeof(ColumnarSegment::Header)) * 8);
+      broken[bit / 8] ^= 1 << (bit % 8);
+    }
+    ColumnarSegment::decode(broken.data(), broken.size(), decoded);
+    CHECK(decoded.size() == records.size());
+  }
+
+  // So must a corrupt header
+  for (int round = 0; round < 2000; round++) {
+    broken = data;
+    broken[8 + random() % (sizeof(ColumnarSegment::Header) - 8)] ^= 1 << (random() % 8);
+    if (ColumnarSegment::decode(broken.data(), broken.size(), decoded)) CHECK(decoded.size() <= broken.size() * 8);
+  }
+}
+
+/// Decode realistic flushes: domains probed every second, 3% timeouts, log-normal query times
+static void benchmark() {
+
+  std::mt19937_64 random(7);
+  std::lognormal_distribution<double> query_time(3.0, 0.6);
+  std::vector<SeriesRecord> records;
+
+  for (uint64_t flush = 0; flush < 10; flush++)
+    for (uint64_t rank = 1; rank <= 25000; rank++)
+      for (uint64_t tick = 0; tick < 4; tick++) {
+        std::string label(4 + random() % 7, ' ');
+        for (auto& c : label) c = "abcdefghijklmnopqrstuvwxyz0123456789"[random() % 36];
+        bool timeout = random() % 100 < 3;
+        records.push_back(record(1700000000000ULL + (4 * flush + tick) * 1000, rank, timeout ? 1000 : query_time(random), timeout ? EV_TIMEOUT : EV_RECV_DATA, label));
+      }
+
+  size_t raw = records.size() * sizeof(SeriesRecord);
+  for (int labels = 1; labels >= 0; labels--) {
+    std::vector<uint8_t> data;
+    ColumnarSegment::encode(records.data(), records.size(), labels, data);
+
+    std::vector<SeriesRecord> decoded;
+    const int rounds = 10;
+    double start = monotonicTime();
+    for (int round = 0; round < rounds; round++) CHECK(ColumnarSegment::decode(data.data(), data.size(), decoded));
+    double elapsed = (monotonicTime() - start) / rounds;
+
+    std::cout << (labels ? "with labels:    " : "without labels: ") << records.size() << " records, " << raw << " -> " << data.size() << " bytes, ratio "
+              << double(raw) / data.size() << ", decoded in " << elapsed << " ms, " << raw / elapsed / 1e+3 << " MB/s" << std::endl;
+  }
+}
+
+int main() {
+  testAdversarial();
+  testCorruption();
+  benchmark();
+
+  if (failures) std::cerr << failures << " checks failed" << std::endl;
+  return failures ? 1 : 0;
+}
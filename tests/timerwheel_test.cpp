@@ -0,0 +1,138 @@
+/**
+* @file timerwheel_test.cpp
+* @brief Timing wheel checked against a brute-force model
+*
+* Timers are scheduled, rescheduled and cancelled at random, near and far
+* beyond the wheel range, while the wheel advances by small steps and large
+* jumps. Every advance must fire exactly the timers whose expiry is reached,
+* once and with their expiry, including the ones rescheduled from fire().
+*
+* To compile, type: "g++ -std=c++11 -O2 -o timerwheel_test tests/timerwheel_test.cpp -I. -I /usr/include/mysql++ -I /usr/include/mysql -L/usr/lib -L/usr/local/lib -lmysqlpp -lldns -lsqlite3 -pthread"
+*/
+
+#include <iostream>
+#include <random>
+#include "dnsprobe.h"
+
+int Log::LOG_LEVEL = LOG_WARN;
+
+using namespace dnsprobe;
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition << std::endl; failures++; } } while (0)
+
+static const uint64_t UNSCHEDULED = UINT64_MAX;
+
+/**
+* @brief Advance the wheel and the model to a tick and compare the fired timers
+* Fired timers are rescheduled by the given function, UNSCHEDULED leaves them be
+*/
+template <class Reschedule>
+static void advance(TimerWheel& wheel, std::vector<uint64_t>& model, uint64_t tick, Reschedule reschedule) {
+
+  // Timers rescheduled into the past at the last tick are left for the next advance
+  std::vector<bool> carried(model.size(), false);
+  size_t errors = 0;
+
+  wheel.advance(tick, [&](uint32_t timer, uint64_t expiry) {
+    if (model[timer] == UNSCHEDULED || expiry != model[timer] || expiry >= wheel.getTick()) errors++;
+    model[timer] = reschedule(timer, expiry);
+    if (model[timer] != UNSCHEDULED) wheel.schedule(timer, model[timer]);
+    carried[timer] = wheel.getTick() > tick && model[timer] <= tick;
+  });
+
+  for (size_t timer = 0; timer < model.size(); timer++)
+    if (model[timer] != UNSCHEDULED && model[timer] <= tick && !carried[timer]) errors++;
+  CHECK(!errors);
+  CHECK(wheel.getTick() == tick + 1);
+}
+
+static void testRandom() {
+
+  std::mt19937_64 random(6);
+  const size_t timers = 20000;
+  uint64_t now = 123456789;
+
+  TimerWheel wheel;
+  wheel.reset(timers, now);
+  std::vector<uint64_t> model(timers, UNSCHEDULED);
+
+  auto expiry = [&random, &now]() -> uint64_t {
+    switch (random() % 5) {
+      case 0:  return now - random() % 1000;              // past
+      case 1:  return now + random() % 256;               // root wheel
+      case 2:  return now + random() % 70000;             // lower levels
+      case 3:  return now + random() % (uint64_t(1) << 34); // beyond the wheel
+      default: return now + random() % 5000000;
+    }
+  };
+
+  for (int round = 0; round < 3000; round++) {
+
+    for (int change = 0; change < 20; change++) {
+      uint32_t timer = random() % timers;
+      if (random() % 4) {
+        model[timer] = expiry();
+        wheel.schedule(timer, model[timer]);
+      } else {
+        model[timer] = UNSCHEDULED;
+        wheel.cancel(timer);
+      }
+      CHECK(wheel.isScheduled(timer) == (model[timer] != UNSCHEDULED));
+    }
+
+    // The next tick that may fire never skips a due timer
+    uint64_t next = wheel.getNextTick(), due = UNSCHEDULED;
+    for (uint64_t e : model) due = std::min(due, e);
+    CHECK(next <= std::max(due, wheel.getTick()));
+
+    uint64_t step = random() % 10 ? 1 + random() % 300 : 1 + random() % (uint64_t(1) << 26);
+    now += step;
+
+    // Half of the fired timers come back, some of them already due
+    advance(wheel, model, now - 1, [&](uint32_t, uint64_t e) {
+      return random() % 2 ? UNSCHEDULED : random() % 8 ? e + 1 + random() % 100000 : e;
+    });
+  }
+
+  // Everything left fires once the farthest expiry is reached
+  uint64_t last = now;
+  for (uint64_t e : model) if (e != UNSCHEDULED) last = std::max(last, e);
+  advance(wheel, model, last, [](uint32_t, uint64_t) { return UNSCHEDULED; });
+  for (size_t timer = 0; timer < timers; timer++) CHECK(!wheel.isScheduled(timer));
+}
+
+/// Periodic timers as probe workers use them
+static void testPeriodic() {
+
+  const size_t timers = 1000000;
+  const uint64_t period = 60000;
+  std::mt19937_64 random(60);
+
+  TimerWheel wheel;
+  wheel.reset(timers, 0);
+  for (uint32_t timer = 0; timer < timers; timer++) wheel.schedule(timer, random() % period);
+
+  size_t late = 0, fired = 0;
+  double start = monotonicTime();
+  for (uint64_t tick = 0; tick < 10 * period; tick++)
+    fired += wheel.advance(tick, [&](uint32_t timer, uint64_t expiry) {
+      if (expiry != tick) late++;
+      wheel.schedule(timer, expiry + period);
+    });
+  double elapsed = monotonicTime() - start;
+
+  CHECK(!late);
+  CHECK(fired == 10 * timers);
+  std::cout << "periodic: " << fired << " timers fired over " << 10 * period << " ticks in " << elapsed << " ms, "
+            << elapsed * 1e+6 / fired << " ns per timer" << std::endl;
+}
+
+int main() {
+  testRandom();
+  testPeriodic();
+
+  if (failures) std::cerr << failures << " checks failed" << std::endl;
+  return failures ? 1 : 0;
+}